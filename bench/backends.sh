@@ -0,0 +1,29 @@
+#!/bin/sh
+# Compares the throughput of the SEARCH_V2 (root) and FIEMAP backends over
+# the same paths.  Each runs twice, the first time to warm the caches for
+# both; the second is the one reported.
+#
+# Usage: [COMPSIZE=./compsize] bench/backends.sh path...
+set -e
+
+COMPSIZE=${COMPSIZE:-$(dirname "$0")/../compsize}
+[ $# -gt 0 ] || { echo "Usage: $0 path..." >&2; exit 1; }
+
+run() {
+    start=$(date +%s%N)
+    out=$("$COMPSIZE" "$@")
+    end=$(date +%s%N)
+    files=$(echo "$out" | sed -n 's/^Processed \([0-9]*\) file.*/\1/p')
+    ms=$(( (end - start) / 1000000 ))
+    [ "$ms" -gt 0 ] || ms=1
+    echo "$files $ms"
+}
+
+printf "%-10s %-10s %-10s %-10s\n" Backend Files Time/ms Files/s
+for backend in search fiemap; do
+    [ $backend = fiemap ] && flag=--fiemap || flag=
+    run $flag "$@" >/dev/null
+    set -- $(run $flag "$@") "$@"
+    printf "%-10s %-10s %-10s %-10s\n" $backend "$1" "$2" $(( $1 * 1000 / $2 ))
+    shift 2
+done
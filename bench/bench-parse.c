@@ -0,0 +1,439 @@
+// Replays synthetic SEARCH_V2 result buffers through two versions of the
+// file extent parsing loop and reports items/s for each:
+//  * fused: one pass per item, like compsize's parse_search_buf() and
+//    parse_file_extent_item();
+//  * soa: headers decoded into flat arrays first, then branch-light passes
+//    for the per-type totals and fragments, then one for deduplication,
+//    in L1-sized strips.
+// Both must agree on the totals.  No btrfs needed.
+//
+// Only a measurement tool: "fused" is a hand copy of the totals part of
+// compsize's parser, without the optional reports, and isn't kept in step
+// with it.  Check it against compsize.c before trusting new numbers.
+//
+// Usage: bench-parse [-n items] [-r repeat%] [-p passes] [-s seed]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <btrfs/ioctl.h>
+#include <btrfs/ctree.h>
+#include "radix-tree.h"
+
+#define PREALLOC 256
+#define MAX_ENTRIES (256+1)
+#define BUF_SIZE (256 * 1024) // compsize's sv2_args.buf
+#define STRIP 256
+
+static void die(const char *txt)
+{
+    fprintf(stderr, "%s", txt);
+    exit(1);
+}
+
+static uint64_t rng_state;
+
+static uint64_t rng(void)
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+// The replay: buffers as SEARCH_V2 fills them, back to back.
+struct replay_buf
+{
+        uint32_t nr_items;
+        uint8_t *buf;
+};
+
+static struct replay_buf *bufs;
+static size_t nbufs;
+
+struct totals
+{
+        uint64_t disk[MAX_ENTRIES], uncomp[MAX_ENTRIES], refd[MAX_ENTRIES];
+        uint64_t nextents, nrefs, ninline, nfrag;
+};
+
+static uint8_t *put_item(uint8_t *bp, uint64_t objectid, uint64_t offset,
+                         const struct btrfs_file_extent_item *ei, uint32_t len)
+{
+    struct btrfs_ioctl_search_header head;
+
+    memset(&head, 0, sizeof(head));
+    head.objectid = objectid;
+    head.offset = offset;
+    head.type = BTRFS_EXTENT_DATA_KEY;
+    head.len = len;
+    memcpy(bp, &head, sizeof(head));
+    memcpy(bp + sizeof(head), ei, len < sizeof(*ei) ? len : sizeof(*ei));
+    return bp + sizeof(head) + len;
+}
+
+// Files of 1-16 items: mostly fresh extents, some shared with an earlier
+// one (reflinks, snapshots), a few holes, prealloc and inline; repeat% of
+// refs point again into the extent of the ref before them.
+struct gen_extent
+{
+        uint64_t disk, disk_len, len;
+        uint8_t type, comp;
+};
+
+static void gen_replay(size_t n, unsigned repeat)
+{
+    static const uint8_t comps[] = { 0, 0, 1, 3, 3, 2 };
+    uint64_t next_disk = 1ULL << 30, objectid = 256, offset = 0;
+    struct gen_extent *extents, *cur = 0;
+    struct btrfs_file_extent_item ei;
+    size_t i, nextents = 0, left = 0, per;
+    uint8_t *bp = 0, *end = 0;
+
+    extents = malloc(n * sizeof(*extents));
+    bufs = calloc(n / 100 + 1, sizeof(*bufs));
+    if (!extents || !bufs)
+        die("Out of memory.\n");
+    per = sizeof(struct btrfs_ioctl_search_header) + sizeof(ei);
+    for (i = 0; i < n; i++)
+    {
+        if (!bp || bp + per + 2048 > end)
+        {
+            bp = malloc(BUF_SIZE);
+            if (!bp)
+                die("Out of memory.\n");
+            end = bp + BUF_SIZE;
+            bufs[nbufs++].buf = bp;
+        }
+        if (!left)
+        {
+            objectid++;
+            offset = 0;
+            left = 1 + rng() % 16;
+            cur = 0;
+        }
+        left--;
+        memset(&ei, 0, sizeof(ei));
+        if (!offset && !left && rng() % 10 == 0)
+        {
+            ei.type = BTRFS_FILE_EXTENT_INLINE;
+            ei.compression = rng() % 2;
+            ei.ram_bytes = 1 + rng() % 2048;
+            bp = put_item(bp, objectid, 0, &ei, 21 + ei.ram_bytes / (1 + ei.compression));
+            bufs[nbufs - 1].nr_items++;
+            continue;
+        }
+
+        if (cur && rng() % 100 < repeat)
+            ; // the same extent again, further in
+        else if (rng() % 20 == 0)
+            cur = 0; // hole
+        else if (nextents && rng() % 10 == 0)
+            cur = &extents[rng() % nextents];
+        else
+        {
+            cur = &extents[nextents++];
+            cur->comp = comps[rng() % sizeof(comps)];
+            cur->type = BTRFS_FILE_EXTENT_REG;
+            if (!cur->comp && rng() % 10 == 0)
+                cur->type = BTRFS_FILE_EXTENT_PREALLOC;
+            cur->len = cur->comp ? 128 << 10 : (4 + rng() % 256) << 12;
+            cur->disk_len = cur->comp ? (1 + rng() % 32) << 12 : cur->len;
+            cur->disk = next_disk;
+            next_disk += cur->disk_len;
+        }
+        ei.type = BTRFS_FILE_EXTENT_REG;
+        if (cur)
+        {
+            ei.type = cur->type;
+            ei.compression = cur->comp;
+            ei.disk_bytenr = cur->disk;
+            ei.disk_num_bytes = cur->disk_len;
+            ei.ram_bytes = cur->len;
+            ei.offset = rng() % (cur->len >> 12) << 12;
+            ei.num_bytes = cur->len - ei.offset;
+        }
+        else
+            ei.num_bytes = ei.ram_bytes = (1 + rng() % 256) << 12;
+        bp = put_item(bp, objectid, offset, &ei, sizeof(ei));
+        bufs[nbufs - 1].nr_items++;
+        offset += ei.num_bytes;
+    }
+    free(extents);
+}
+
+static struct radix_tree_root seen;
+
+static void seen_reset(void)
+{
+    void *batch[256];
+    unsigned long index = 0;
+    unsigned int i, got;
+
+    while ((got = radix_tree_gang_lookup(&seen, batch, index, 256)))
+    {
+        index = (uintptr_t)batch[got - 1] + 1;
+        for (i = 0; i < got; i++)
+            radix_tree_delete(&seen, (uintptr_t)batch[i]);
+    }
+}
+
+static int seen_insert(uint64_t pageno)
+{
+    int ret;
+
+    radix_tree_preload(GFP_KERNEL);
+    ret = radix_tree_insert(&seen, pageno, (void *)(uintptr_t)pageno) == 0;
+    radix_tree_preload_end();
+    return ret;
+}
+
+// What parse_search_buf() + parse_file_extent_item() do for the totals.
+static void run_fused(struct totals *t)
+{
+    struct btrfs_ioctl_search_header *head;
+    struct btrfs_file_extent_item *ei;
+    uint64_t objectid, last = 0, fragend = -1;
+    uint64_t disk_bytenr, disk_num_bytes, ram_bytes, num_bytes;
+    uint32_t hlen, nr_items;
+    unsigned comp_type;
+    uint8_t *bp;
+    size_t b;
+    int is_new;
+
+    for (b = 0; b < nbufs; b++)
+    {
+        bp = bufs[b].buf;
+        for (nr_items = bufs[b].nr_items; nr_items > 0; nr_items--, bp += hlen)
+        {
+            head = (struct btrfs_ioctl_search_header *)bp;
+            hlen = get_unaligned_32(&head->len);
+            objectid = get_unaligned_64(&head->objectid);
+            bp += sizeof(*head);
+            if (objectid != last)
+            {
+                last = objectid;
+                fragend = -1;
+            }
+            if (get_unaligned_32(&head->type) != BTRFS_EXTENT_DATA_KEY)
+                continue;
+
+            ei = (struct btrfs_file_extent_item *)bp;
+            ram_bytes = get_unaligned_le64(&ei->ram_bytes);
+            comp_type = ei->compression;
+            if (ei->type == BTRFS_FILE_EXTENT_INLINE)
+            {
+                t->disk[comp_type] += hlen - 21;
+                t->uncomp[comp_type] += ram_bytes;
+                t->refd[comp_type] += ram_bytes;
+                t->ninline++;
+                t->nfrag++;
+                fragend = -1;
+                continue;
+            }
+            if (ei->type == BTRFS_FILE_EXTENT_PREALLOC)
+                comp_type = PREALLOC;
+            disk_num_bytes = get_unaligned_le64(&ei->disk_num_bytes);
+            disk_bytenr = get_unaligned_le64(&ei->disk_bytenr);
+            num_bytes = get_unaligned_le64(&ei->num_bytes);
+            if (!disk_bytenr)
+                continue;
+
+            is_new = seen_insert(disk_bytenr >> 12);
+            if (is_new)
+            {
+                t->disk[comp_type] += disk_num_bytes;
+                t->uncomp[comp_type] += ram_bytes;
+                t->nextents++;
+            }
+            t->refd[comp_type] += num_bytes;
+            t->nrefs++;
+            t->nfrag += disk_bytenr != fragend;
+            fragend = disk_bytenr + disk_num_bytes;
+        }
+    }
+}
+
+// Structure of arrays: a strip of items decoded, then reduced.
+static struct
+{
+        uint64_t bytenr[STRIP], disk[STRIP], ram[STRIP], num[STRIP];
+        uint16_t comp[STRIP];
+        uint8_t newfile[STRIP], isinline[STRIP];
+} soa;
+
+static void soa_reduce(struct totals *t, size_t n, uint64_t *fragend)
+{
+    uint64_t end = *fragend, reg;
+    unsigned c;
+    size_t i;
+
+    // Refs and fragments: no branches on the item's kind, holes and the
+    // items of other keys weigh nothing (num 0) and keep end.
+    for (i = 0; i < n; i++)
+    {
+        reg = !soa.isinline[i] & (soa.bytenr[i] != 0);
+        end = soa.newfile[i] ? (uint64_t)-1 : end;
+        c = soa.comp[i];
+        t->refd[c] += soa.num[i];
+        t->nrefs += reg;
+        t->nfrag += soa.isinline[i] | (reg & (soa.bytenr[i] != end));
+        t->ninline += soa.isinline[i];
+        end = soa.isinline[i] ? (uint64_t)-1
+            : reg ? soa.bytenr[i] + soa.disk[i] : end;
+    }
+    *fragend = end;
+
+    // Extents, once each.
+    for (i = 0; i < n; i++)
+    {
+        if (soa.isinline[i])
+        {
+            t->disk[soa.comp[i]] += soa.disk[i];
+            t->uncomp[soa.comp[i]] += soa.ram[i];
+        }
+        else if (soa.bytenr[i] && seen_insert(soa.bytenr[i] >> 12))
+        {
+            t->disk[soa.comp[i]] += soa.disk[i];
+            t->uncomp[soa.comp[i]] += soa.ram[i];
+            t->nextents++;
+        }
+    }
+}
+
+static void run_soa(struct totals *t)
+{
+    struct btrfs_ioctl_search_header *head;
+    struct btrfs_file_extent_item *ei;
+    uint64_t objectid, last = 0, fragend = -1;
+    uint32_t hlen, nr_items;
+    uint8_t *bp;
+    size_t b, n;
+
+    for (b = 0; b < nbufs; b++)
+    {
+        bp = bufs[b].buf;
+        n = 0;
+        for (nr_items = bufs[b].nr_items; nr_items > 0; nr_items--, bp += hlen)
+        {
+            head = (struct btrfs_ioctl_search_header *)bp;
+            hlen = get_unaligned_32(&head->len);
+            objectid = get_unaligned_64(&head->objectid);
+            ei = (struct btrfs_file_extent_item *)(bp + sizeof(*head));
+            bp += sizeof(*head);
+            soa.newfile[n] = objectid != last;
+            last = objectid;
+            if (get_unaligned_32(&head->type) != BTRFS_EXTENT_DATA_KEY)
+            {
+                soa.isinline[n] = 0;
+                soa.bytenr[n] = soa.num[n] = 0;
+                soa.comp[n] = 0;
+            }
+            else if ((soa.isinline[n] = ei->type == BTRFS_FILE_EXTENT_INLINE))
+            {
+                soa.comp[n] = ei->compression;
+                soa.bytenr[n] = 0;
+                soa.disk[n] = hlen - 21;
+                soa.ram[n] = soa.num[n] = get_unaligned_le64(&ei->ram_bytes);
+            }
+            else
+            {
+                soa.comp[n] = ei->type == BTRFS_FILE_EXTENT_PREALLOC
+                              ? PREALLOC : ei->compression;
+                soa.bytenr[n] = get_unaligned_le64(&ei->disk_bytenr);
+                soa.disk[n] = get_unaligned_le64(&ei->disk_num_bytes);
+                soa.ram[n] = get_unaligned_le64(&ei->ram_bytes);
+                soa.num[n] = soa.bytenr[n] ? get_unaligned_le64(&ei->num_bytes) : 0;
+            }
+            if (++n == STRIP)
+            {
+                soa_reduce(t, n, &fragend);
+                n = 0;
+            }
+        }
+        soa_reduce(t, n, &fragend);
+    }
+}
+
+static const struct
+{
+        const char *name;
+        void (*run)(struct totals *t);
+} kernels[] = {
+        { "fused", run_fused },
+        { "soa",   run_soa },
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    static struct totals ref, t;
+    uint64_t start, best;
+    size_t n = 4000000;
+    unsigned long seed = 1;
+    unsigned repeat = 25, k;
+    int passes = 5, p, opt;
+
+    while ((opt = getopt(argc, argv, "n:r:p:s:")) != -1)
+        switch (opt)
+        {
+        case 'n':
+            n = strtoul(optarg, 0, 0);
+            break;
+        case 'r':
+            repeat = strtoul(optarg, 0, 0);
+            break;
+        case 'p':
+            passes = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, 0, 0);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n items] [-r repeat%%] [-p passes] [-s seed]\n",
+                    argv[0]);
+            return 1;
+        }
+    if (!n || passes < 1 || repeat > 100)
+        die("Need some items, passes, and a repeat% of 0-100.\n");
+
+    rng_state = seed * 0x2545F4914F6CDD1DULL + 1;
+    gen_replay(n, repeat);
+    radix_tree_init();
+    INIT_RADIX_TREE(&seen, 0);
+
+    printf("%zu items in %zu buffers, %u%% repeating the previous extent, best of %d.\n",
+           n, nbufs, repeat, passes);
+    printf("%-7s %-10s %-10s\n", "Parser", "Mitems/s", "ns/item");
+    for (k = 0; k < sizeof(kernels) / sizeof(*kernels); k++)
+    {
+        best = -1;
+        for (p = 0; p < passes; p++)
+        {
+            memset(&t, 0, sizeof(t));
+            start = now_ns();
+            kernels[k].run(&t);
+            start = now_ns() - start;
+            if (start < best)
+                best = start;
+            seen_reset();
+        }
+        if (!k)
+            ref = t;
+        else if (memcmp(&ref, &t, sizeof(t)))
+            die("Parsers disagree on the totals!\n");
+        printf("%-7s %-10.2f %-10.2f\n", kernels[k].name, n / (best / 1e9) / 1e6,
+               (double)best / n);
+    }
+    return 0;
+}
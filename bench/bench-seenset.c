@@ -0,0 +1,415 @@
+// Microbenchmark of candidate structures for compsize's set of seen extents:
+// "insert this key, tell me if it's new", keys being bytenr>>12.  Runs each
+// structure against a few synthetic key streams shaped like real scans and
+// reports inserts/s, memory per distinct key and (if perf events are
+// available) cache misses per insert.  No btrfs needed.
+//
+// Usage: bench-seenset [-n keys] [-s seed]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <malloc.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "radix-tree.h"
+
+static void die(const char *txt)
+{
+    fprintf(stderr, "%s", txt);
+    exit(1);
+}
+
+static uint64_t rng_state;
+
+static uint64_t rng(void)
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+// Key streams, in pages (4K).
+
+// One big file: 128K (compressed) extents one after another.
+static void gen_sequential(uint64_t *keys, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        keys[i] = (1ULL << 18) + i * 32;
+}
+
+// Many small files: single extents anywhere in 1TB.
+static void gen_random(uint64_t *keys, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        keys[i] = rng() % (1ULL << 28);
+}
+
+// Heavy reflinking (snapshots, dedup): every extent referenced 8 times on
+// average, mostly in runs as cloned files are scanned one after another.
+static void gen_reflink(uint64_t *keys, size_t n)
+{
+    size_t distinct = n / 8 ? n / 8 : 1, i = 0, run, j;
+    uint64_t start;
+
+    while (i < n)
+    {
+        start = rng() % distinct;
+        run = 1 + rng() % 64;
+        for (j = 0; j < run && i < n; j++, i++)
+            keys[i] = (1ULL << 20) + (start + j) % distinct * 32;
+    }
+}
+
+// Files scattered over a 64TB address space, each a run of 1-16 extents.
+static void gen_sparse(uint64_t *keys, size_t n)
+{
+    size_t i = 0, run, j;
+    uint64_t start;
+
+    while (i < n)
+    {
+        start = rng() % (1ULL << 34);
+        run = 1 + rng() % 16;
+        for (j = 0; j < run && i < n; j++, i++)
+            keys[i] = start + j * 32;
+    }
+}
+
+static const struct
+{
+        const char *name;
+        void (*gen)(uint64_t *keys, size_t n);
+} streams[] = {
+        { "sequential", gen_sequential },
+        { "random",     gen_random },
+        { "reflink",    gen_reflink },
+        { "sparse",     gen_sparse },
+};
+
+// The structures.  run() inserts all keys and returns how many were new;
+// the memory it holds is measured before done() frees it.
+
+struct seen_set
+{
+        const char *name;
+        void (*init)(void);
+        size_t (*run)(const uint64_t *keys, size_t n);
+        void (*done)(void);
+};
+
+// radix-tree.c, as used by compsize.
+static struct radix_tree_root radix;
+
+static void radix_init(void)
+{
+    INIT_RADIX_TREE(&radix, 0);
+}
+
+static size_t radix_run(const uint64_t *keys, size_t n)
+{
+    size_t i, nnew = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        radix_tree_preload(GFP_KERNEL);
+        // key + 1, as the item can't be NULL
+        nnew += radix_tree_insert(&radix, keys[i], (void *)(uintptr_t)(keys[i] + 1)) == 0;
+        radix_tree_preload_end();
+    }
+    return nnew;
+}
+
+static void radix_done(void)
+{
+    void *batch[256];
+    unsigned long index = 0;
+    unsigned int i, got;
+
+    while ((got = radix_tree_gang_lookup(&radix, batch, index, 256)))
+    {
+        index = (uintptr_t)batch[got - 1];
+        for (i = 0; i < got; i++)
+            radix_tree_delete(&radix, (uintptr_t)batch[i] - 1);
+    }
+}
+
+// Open addressing, linear probing, kept at most half full.
+static uint64_t *hash_slots;
+static size_t hash_size, hash_used;
+
+static inline size_t hash_key(uint64_t key)
+{
+    key *= 0x9e3779b97f4a7c15ULL;
+    return key ^ key >> 32;
+}
+
+static void hash_init(void)
+{
+    hash_size = 1024;
+    hash_used = 0;
+    hash_slots = calloc(hash_size, sizeof(*hash_slots));
+    if (!hash_slots)
+        die("Out of memory.\n");
+}
+
+static int hash_insert(uint64_t *slots, size_t size, uint64_t key)
+{
+    size_t i = hash_key(key) & (size - 1);
+
+    // key + 1, so that 0 can mean empty
+    while (slots[i])
+    {
+        if (slots[i] == key + 1)
+            return 0;
+        i = (i + 1) & (size - 1);
+    }
+    slots[i] = key + 1;
+    return 1;
+}
+
+static size_t hash_run(const uint64_t *keys, size_t n)
+{
+    uint64_t *bigger;
+    size_t i, j, nnew = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        if (hash_used * 2 >= hash_size)
+        {
+            bigger = calloc(hash_size * 2, sizeof(*bigger));
+            if (!bigger)
+                die("Out of memory.\n");
+            for (j = 0; j < hash_size; j++)
+                if (hash_slots[j])
+                    hash_insert(bigger, hash_size * 2, hash_slots[j] - 1);
+            free(hash_slots);
+            hash_slots = bigger;
+            hash_size *= 2;
+        }
+        if (hash_insert(hash_slots, hash_size, keys[i]))
+            hash_used++, nnew++;
+    }
+    return nnew;
+}
+
+static void hash_done(void)
+{
+    free(hash_slots);
+}
+
+// A bit per page, in 32KB leaves allocated on first touch, under a flat
+// directory covering 2^40 pages (4PB).
+#define LEAF_BITS 18
+#define DIR_SIZE (1UL << (40 - LEAF_BITS))
+
+static uint64_t **bitmap_dir;
+
+static void bitmap_init(void)
+{
+    bitmap_dir = calloc(DIR_SIZE, sizeof(*bitmap_dir));
+    if (!bitmap_dir)
+        die("Out of memory.\n");
+}
+
+static size_t bitmap_run(const uint64_t *keys, size_t n)
+{
+    uint64_t *leaf, bit;
+    size_t i, nnew = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        leaf = bitmap_dir[keys[i] >> LEAF_BITS];
+        if (!leaf)
+        {
+            leaf = calloc(1 << (LEAF_BITS - 6), sizeof(*leaf));
+            if (!leaf)
+                die("Out of memory.\n");
+            bitmap_dir[keys[i] >> LEAF_BITS] = leaf;
+        }
+        bit = keys[i] & ((1 << LEAF_BITS) - 1);
+        if (!(leaf[bit >> 6] & 1ULL << (bit & 63)))
+        {
+            leaf[bit >> 6] |= 1ULL << (bit & 63);
+            nnew++;
+        }
+    }
+    return nnew;
+}
+
+static void bitmap_done(void)
+{
+    size_t i;
+
+    for (i = 0; i < DIR_SIZE; i++)
+        free(bitmap_dir[i]);
+    free(bitmap_dir);
+}
+
+// Append everything, sort and count distinct at the end.  Can't tell
+// whether a key is new when it's inserted, so it would only do for totals
+// that don't depend on that.
+static uint64_t *sorted;
+static size_t nsorted, sorted_alloc;
+
+static void sort_init(void)
+{
+    nsorted = sorted_alloc = 0;
+    sorted = 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static size_t sort_run(const uint64_t *keys, size_t n)
+{
+    size_t i, nnew = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        if (nsorted >= sorted_alloc)
+        {
+            sorted_alloc = sorted_alloc ? sorted_alloc * 2 : 65536;
+            sorted = realloc(sorted, sorted_alloc * sizeof(*sorted));
+            if (!sorted)
+                die("Out of memory.\n");
+        }
+        sorted[nsorted++] = keys[i];
+    }
+    qsort(sorted, nsorted, sizeof(*sorted), cmp_u64);
+    for (i = 0; i < nsorted; i++)
+        nnew += !i || sorted[i] != sorted[i - 1];
+    return nnew;
+}
+
+static void sort_done(void)
+{
+    free(sorted);
+}
+
+static const struct seen_set sets[] = {
+        { "radix",  radix_init,  radix_run,  radix_done },
+        { "hash",   hash_init,   hash_run,   hash_done },
+        { "bitmap", bitmap_init, bitmap_run, bitmap_done },
+        { "sort",   sort_init,   sort_run,   sort_done },
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t heap_bytes(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 mi = mallinfo2();
+#else
+    struct mallinfo mi = mallinfo();
+#endif
+    return (size_t)mi.uordblks + (size_t)mi.hblkhd;
+}
+
+// -1 if perf events aren't available (no PMU, perf_event_paranoid, ...).
+static int open_cache_misses(void)
+{
+    struct perf_event_attr pe;
+
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_CACHE_MISSES;
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t *keys, t, misses;
+    size_t n = 4000000, nnew, base, mem;
+    unsigned long seed = 1;
+    unsigned int s, k;
+    int perf, opt;
+    char mbuf[16];
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1)
+        switch (opt)
+        {
+        case 'n':
+            n = strtoul(optarg, 0, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, 0, 0);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n keys] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    if (!n)
+        die("Need some keys.\n");
+
+    keys = malloc(n * sizeof(*keys));
+    if (!keys)
+        die("Out of memory.\n");
+    radix_tree_init();
+    perf = open_cache_misses();
+
+    printf("%zu inserts per run%s.\n", n,
+           perf == -1 ? ", no perf events for cache misses" : "");
+    printf("%-11s %-7s %-10s %-10s %-10s %-10s\n", "Stream", "Set",
+           "Distinct", "Minsert/s", "Bytes/key", "Miss/ins");
+    for (s = 0; s < sizeof(streams) / sizeof(*streams); s++)
+    {
+        rng_state = seed * 0x2545F4914F6CDD1DULL + s + 1;
+        streams[s].gen(keys, n);
+        for (k = 0; k < sizeof(sets) / sizeof(*sets); k++)
+        {
+            base = heap_bytes();
+            sets[k].init();
+            if (perf != -1)
+            {
+                ioctl(perf, PERF_EVENT_IOC_RESET, 0);
+                ioctl(perf, PERF_EVENT_IOC_ENABLE, 0);
+            }
+            t = now_ns();
+            nnew = sets[k].run(keys, n);
+            t = now_ns() - t;
+            if (perf != -1)
+            {
+                ioctl(perf, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(perf, &misses, sizeof(misses)) != sizeof(misses))
+                    misses = 0;
+                snprintf(mbuf, sizeof(mbuf), "%.2f", (double)misses / n);
+            }
+            else
+                strcpy(mbuf, "-");
+            mem = heap_bytes() - base;
+            sets[k].done();
+
+            printf("%-11s %-7s %-10zu %-10.2f %-10.1f %-10s\n", streams[s].name,
+                   sets[k].name, nnew, n / (t / 1e9) / 1e6,
+                   nnew ? (double)mem / nnew : 0.0, mbuf);
+        }
+    }
+
+    free(keys);
+    return 0;
+}
@@ -14,6 +14,28 @@
 #include <linux/limits.h>
 #include <getopt.h>
 #include <signal.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <time.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/fanotify.h>
+#include <poll.h>
+#include <pwd.h>
+#include <grp.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZO
+#include <lzo1x.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 #include "radix-tree.h"
 #include "endianness.h"
 
@@ -32,11 +54,155 @@
  #define SZ_16M 16777216
 #endif
 
+#ifndef IOPRIO_CLASS_SHIFT
+ // no glibc wrapper, nor header
+ #define IOPRIO_CLASS_SHIFT 13
+ #define IOPRIO_CLASS_IDLE 3
+ #define IOPRIO_WHO_PROCESS 1
+#endif
+
+#ifndef BTRFS_BLOCK_GROUP_RAID1C3
+ // pre-5.5 headers
+ #define BTRFS_BLOCK_GROUP_RAID1C3 (1ULL << 9)
+ #define BTRFS_BLOCK_GROUP_RAID1C4 (1ULL << 10)
+#endif
+
+#ifndef BTRFS_BLOCK_GROUP_TREE_OBJECTID
+ #define BTRFS_BLOCK_GROUP_TREE_OBJECTID 11ULL
+#endif
+
+#ifndef SCHED_IDLE
+ // glibc hides it without _GNU_SOURCE
+ #define SCHED_IDLE 5
+#endif
+
+#ifndef BTRFS_LOGICAL_INO_ARGS_IGNORE_OFFSET
+ // btrfs-progs < 4.15
+ #define BTRFS_IOC_LOGICAL_INO_V2 _IOWR(BTRFS_IOCTL_MAGIC, 59, \
+                                       struct btrfs_ioctl_logical_ino_args)
+ #define BTRFS_LOGICAL_INO_ARGS_IGNORE_OFFSET (1ULL << 0)
+#endif
+
 struct btrfs_sv2_args
 {
     struct btrfs_ioctl_search_key key;
     uint64_t buf_size;
-    uint8_t  buf[65536]; // hardcoded kernel's limit is 16MB
+    uint8_t  buf[262144]; // hardcoded kernel's limit is 16MB
+};
+
+// No item can be larger than a tree node, which is at most 64K.
+#define MAX_ITEM_SIZE (65536 + sizeof(struct btrfs_ioctl_search_header))
+
+struct inode_info
+{
+        uint64_t generation;
+        uint64_t transid; // last changed in
+        int64_t ctime;
+        uint64_t size;
+        uint64_t flags;
+        uint32_t nlink;
+        uint32_t uid, gid;
+        uint32_t mode;
+};
+
+struct est_group;
+
+struct file_stats
+{
+        uint64_t refd;
+        uint64_t nfrag;
+        uint32_t name; // index in file_names, + 1, once needed
+        struct est_group *est_dir, *est_ext; // --estimate
+        uint64_t amp_ram, amp_refd; // --read-amp: decompressed, referenced
+        double amp_worst;
+        struct inode_info inode;
+};
+
+struct frag_entry
+{
+        char *path;
+        uint64_t nfrag;
+        uint64_t bytes;
+};
+
+// Per-extent details, kept as the seen_extents value when a report needs
+// more than just whether an extent was seen before.
+struct extent_rec
+{
+        uint64_t bytenr;
+        uint64_t disk;
+        uint64_t uncomp;
+        uint64_t refd;
+        uint64_t groups; // bitmask of groups referencing it
+        uint16_t comp_type;
+        uint8_t flags;
+        uint32_t refs; // file extent items pointing to it
+        struct bookend *bookend;
+        uint64_t generation; // transaction that wrote it
+        struct owner_stats *owner; // charged for it (--by-owner)
+};
+
+#define MAX_GROUPS 64
+
+// Arguments, or subvolumes, to compare for --share-matrix or --per-arg.
+struct share_group
+{
+        const char *label;
+        uint64_t root;
+        struct workspace *ws; // --per-arg
+};
+
+#define EXT_RESOLVED    1 // backrefs looked up
+#define EXT_SHARED      2 // referenced by a file outside our set
+#define EXT_COVERED     4 // all of it is referenced (--bookend)
+#define EXT_OWNERS      8 // used by files of more than one owner
+
+// Parts of an extent referenced so far, if not all of it (--bookend):
+// sorted, disjoint [start, end) ranges of its uncompressed data, and the
+// first file that left some of it unreferenced.
+struct bookend
+{
+        uint32_t owner; // index into file_names, + 1
+        uint32_t n, alloc;
+        struct byte_range
+        {
+                uint64_t start, end;
+        } r[];
+};
+
+// Inodes we've searched, per subvolume, to tell which backrefs are ours.
+struct root_inodes
+{
+        uint64_t root;
+        struct radix_tree_root inodes;
+};
+
+// --watch: what each file contributed, so that it can be taken back out
+// when the file changes or goes away.
+struct watch_ref
+{
+        struct extent_rec *rec; // 0 for inline
+        uint64_t disk;          // inline only
+        uint64_t num_bytes;
+        uint16_t comp_type;
+        uint8_t frag;
+};
+
+struct watched_file
+{
+        uint64_t ino;
+        int counted;
+        int dirty;
+        size_t n, alloc;
+        struct watch_ref *refs;
+};
+
+struct watch_root
+{
+        uint64_t root;
+        int fd;                       // a directory in it, to search from
+        struct radix_tree_root files; // ino -> watched_file
+        struct radix_tree_root dirs;  // ino -> path
 };
 
 struct workspace
@@ -50,14 +216,87 @@ struct workspace
         uint64_t nfiles;
         uint64_t nextents, nrefs, ninline, nfrag;
         uint64_t fragend;
+        struct file_stats file;
         struct radix_tree_root seen_extents;
+        struct workspace *group; // --per-arg totals for the current argument
 };
 
 static const char *comp_types[MAX_ENTRIES] = { "none", "zlib", "lzo", "zstd" };
 
 static int opt_bytes = 0;
 static int opt_one_fs = 0;
+static int opt_inode_items = 0;
+static int opt_exclusive = 0;
+static int opt_extent_recs = 0;
+static int opt_jobs = 0;
+static int opt_share_matrix = 0; // 'a'rgs or 's'ubvolumes
+static int opt_per_arg = 0;
+static int opt_pipeline = 0;
+static const char *opt_emit_set;
+static int opt_merge = 0;
+static int opt_readdir_order = 0;
+static int opt_scan_stats = 0;
+static int opt_idle = 0;
+static int opt_watch = 0;
+static int opt_share_histogram = 0;
+static int opt_bookend = 0;
+static int opt_bookend_top = 10;
+static double opt_estimate = 0; // percent of blocks sampled
+static int opt_age = 0; // 'g'eneration or 't'ime
+static int opt_layout = 0;
+static const char *opt_per_file; // --per-file output, "-" for stdout
+static int opt_print0 = 0;
+static const char *opt_checkpoint;
+static int opt_checkpoint_interval = 300; // seconds
+static int opt_resume = 0;
+static int opt_keep_going = 0;
+static int opt_fiemap = 0; // unprivileged backend, also on EPERM
+static int opt_owner = 0; // 'u'id or 'g'id
+static int opt_by_ext = 0; // how many extensions to list, 0 = off
+static int opt_read_amp = 0; // how many files to list, 0 = off
+
+// Paths of files that reports need to name (--bookend, --estimate).
+static char **file_names;
+static uint32_t nfile_names, file_names_alloc;
+static int opt_frag_report = 0;
+static const char *opt_frag_file;
+static FILE *frag_out;
+static uint64_t opt_frag_min = 2;
+static int opt_frag_sort = 'd';
 static int sig_stats = 0;
+static int sig_checkpoint = 0;
+
+// --scan-stats: how much work the traversal took, to compare orders.
+static struct
+{
+        uint64_t dirs, files, searches;
+        uint64_t items, foreign; // found, and of those not the batch's files
+} scan_stats;
+
+static struct frag_entry *frag_list;
+static size_t frag_count, frag_alloc;
+
+struct filters
+{
+        const char **exclude;
+        int nexclude, nslashed;
+        regex_t *exclude_re;
+        int nexclude_re;
+        const char **name;
+        int nname;
+        uint64_t min_size, max_size;
+        time_t newer, older;
+        int need_stat;
+};
+
+static struct filters filt = { .max_size = -1 };
+
+static struct root_inodes *scanned;
+static int nscanned;
+static int fs_fd = -1;
+
+static struct share_group groups[MAX_GROUPS];
+static int ngroups, cur_group;
 
 static int print_stats(struct workspace *ws);
 
@@ -72,378 +311,4996 @@ static void die(const char *txt, ...)
     exit(1);
 }
 
+// Errors skipped over with --keep-going, reported at the end.
+static char **errors;
+static size_t nerrors, errors_alloc;
+static pthread_mutex_t errors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void add_error(const char *msg)
+{
+    pthread_mutex_lock(&errors_lock);
+    if (nerrors >= errors_alloc)
+    {
+        errors_alloc = errors_alloc ? errors_alloc * 2 : 64;
+        errors = realloc(errors, errors_alloc * sizeof(*errors));
+        if (!errors)
+            die("Out of memory.\n");
+    }
+    if (!(errors[nerrors++] = strdup(msg)))
+        die("Out of memory.\n");
+    pthread_mutex_unlock(&errors_lock);
+}
+
+// For errors about one file or directory: like die(), but with
+// --keep-going only recorded, and the caller skips what it was doing.
+static void fail(const char *txt, ...) __attribute__((format (printf, 1, 2)));
+static void fail(const char *txt, ...)
+{
+    char buf[PATH_MAX + 256];
+    va_list ap;
+
+    va_start(ap, txt);
+    if (!opt_keep_going)
+    {
+        vfprintf(stderr, txt, ap);
+        exit(1);
+    }
+    vsnprintf(buf, sizeof(buf), txt, ap);
+    va_end(ap);
+    fputs(buf, stderr);
+    add_error(buf);
+}
+
 static void sigusr1(int dummy)
 {
     sig_stats = 1;
 }
 
-static void init_sv2_args(ino_t st_ino, struct btrfs_sv2_args *sv2_args)
+static void sigterm(int dummy)
+{
+    sig_checkpoint = 1;
+}
+
+static void init_sv2_args(uint64_t min_ino, uint64_t max_ino,
+                          struct btrfs_sv2_args *sv2_args)
 {
+        // With --inode-items, INODE_ITEM (which sorts first) comes along.
+        // The key range is contiguous, so we'll also get refs and xattrs.
         sv2_args->key.tree_id = 0;
-        sv2_args->key.max_objectid = st_ino;
-        sv2_args->key.min_objectid = st_ino;
+        sv2_args->key.max_objectid = max_ino;
+        sv2_args->key.min_objectid = min_ino;
         sv2_args->key.min_offset = 0;
         sv2_args->key.max_offset = -1;
         sv2_args->key.min_transid = 0;
         sv2_args->key.max_transid = -1;
-        // Only search for EXTENT_DATA_KEY
-        sv2_args->key.min_type = BTRFS_EXTENT_DATA_KEY;
+        // Otherwise only search for EXTENT_DATA_KEY
+        sv2_args->key.min_type = opt_inode_items ? BTRFS_INODE_ITEM_KEY
+                                                 : BTRFS_EXTENT_DATA_KEY;
         sv2_args->key.max_type = BTRFS_EXTENT_DATA_KEY;
         sv2_args->key.nr_items = -1;
         sv2_args->buf_size = sizeof(sv2_args->buf);
 }
 
-static inline int is_hole(uint64_t disk_bytenr)
+// Records of extents no longer referenced (--watch), for reuse.
+static struct extent_rec **free_recs;
+static size_t nfree_recs, free_recs_alloc;
+
+static struct extent_rec *new_extent_rec(void)
 {
-    return disk_bytenr == 0;
+    static struct extent_rec *chunk;
+    static int left;
+
+    if (nfree_recs)
+    {
+        struct extent_rec *rec = free_recs[--nfree_recs];
+        memset(rec, 0, sizeof(*rec));
+        return rec;
+    }
+    if (!left)
+    {
+        left = 4096;
+        chunk = calloc(left, sizeof(*chunk));
+        if (!chunk)
+            die("Out of memory.\n");
+    }
+    return &chunk[--left];
 }
 
-static void parse_file_extent_item(uint8_t *bp, uint32_t hlen,
-                                   struct workspace *ws, const char *filename)
+static void free_extent_rec(struct extent_rec *rec)
 {
-    struct btrfs_file_extent_item *ei;
-    uint64_t disk_num_bytes, ram_bytes, disk_bytenr, num_bytes;
-    uint32_t inline_header_sz;
-    unsigned  comp_type;
-
-    DPRINTF("len=%u\n", hlen);
+    if (nfree_recs >= free_recs_alloc)
+    {
+        free_recs_alloc = free_recs_alloc ? free_recs_alloc * 2 : 4096;
+        free_recs = realloc(free_recs, free_recs_alloc * sizeof(*free_recs));
+        if (!free_recs)
+            die("Out of memory.\n");
+    }
+    free_recs[nfree_recs++] = rec;
+}
 
-    ei = (struct btrfs_file_extent_item *) bp;
+static struct pipeline *pipe_line;
 
-    ram_bytes = get_unaligned_le64(&ei->ram_bytes);
-    comp_type = ei->compression;
+// radix-tree.c's preload pool and node count are global, so with --pipeline
+// the traversal and the parser take turns changing any of the trees.
+static pthread_mutex_t radix_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    if (ei->type == BTRFS_FILE_EXTENT_INLINE)
-    {
-        inline_header_sz  = sizeof(*ei);
-        inline_header_sz -= sizeof(ei->disk_bytenr);
-        inline_header_sz -= sizeof(ei->disk_num_bytes);
-        inline_header_sz -= sizeof(ei->offset);
-        inline_header_sz -= sizeof(ei->num_bytes);
+static void radix_begin(void)
+{
+    if (pipe_line)
+        pthread_mutex_lock(&radix_lock);
+    radix_tree_preload(GFP_KERNEL);
+}
 
-        disk_num_bytes = hlen-inline_header_sz;
-        DPRINTF("inline: ram_bytes=%lu compression=%u disk_num_bytes=%lu\n",
-             ram_bytes, comp_type, disk_num_bytes);
-        ws->disk[comp_type] += disk_num_bytes;
-        ws->uncomp[comp_type] += ram_bytes;
-        ws->refd[comp_type] += ram_bytes;
-        ws->ninline++;
-        ws->nfrag++;
-        ws->fragend = -1;
-        return;
-    }
+static void radix_end(void)
+{
+    radix_tree_preload_end();
+    if (pipe_line)
+        pthread_mutex_unlock(&radix_lock);
+}
 
-    if (ei->type == BTRFS_FILE_EXTENT_PREALLOC)
-        comp_type = PREALLOC;
+// Subvolume id of the tree fd lives in; cached, as every subvolume has
+// its own st_dev.
+static uint64_t file_root(int fd, dev_t dev)
+{
+    static dev_t last_dev;
+    static uint64_t last_root;
+    struct btrfs_ioctl_ino_lookup_args args;
 
-    if (hlen != sizeof(*ei))
-        die("%s: Regular extent's header not 53 bytes (%u) long?!?\n", filename, hlen);
+    if (last_root && dev == last_dev)
+        return last_root;
 
-    disk_num_bytes = get_unaligned_le64(&ei->disk_num_bytes);
-    disk_bytenr = get_unaligned_le64(&ei->disk_bytenr);
-    num_bytes = get_unaligned_le64(&ei->num_bytes);
+    memset(&args, 0, sizeof(args));
+    args.objectid = BTRFS_FIRST_FREE_OBJECTID;
+    if (ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args))
+        die("INO_LOOKUP: %m\n");
+    last_dev = dev;
+    return last_root = args.treeid;
+}
 
-    if (is_hole(disk_bytenr))
-        return;
+static struct radix_tree_root *find_root_inodes(uint64_t root)
+{
+    int i;
 
-    DPRINTF("regular: ram_bytes=%lu compression=%u disk_num_bytes=%lu disk_bytenr=%lu\n",
-         ram_bytes, comp_type, disk_num_bytes, disk_bytenr);
+    for (i = 0; i < nscanned; i++)
+        if (scanned[i].root == root)
+            return &scanned[i].inodes;
+    return 0;
+}
 
-    if (!IS_ALIGNED(disk_bytenr, 1 << 12))
-        die("%s: Extent not 4K-aligned at %"PRIu64"?!?\n", filename, disk_bytenr);
+static struct radix_tree_root *root_inodes(uint64_t root)
+{
+    struct radix_tree_root *ri;
 
-    unsigned long pageno = disk_bytenr >> 12;
-    radix_tree_preload(GFP_KERNEL);
-    if (radix_tree_insert(&ws->seen_extents, pageno, (void *)pageno) == 0)
-    {
-         ws->disk[comp_type] += disk_num_bytes;
-         ws->uncomp[comp_type] += ram_bytes;
-         ws->nextents++;
-    }
-    radix_tree_preload_end();
-    ws->refd[comp_type] += num_bytes;
-    ws->nrefs++;
+    if ((ri = find_root_inodes(root)))
+        return ri;
 
-    if (disk_bytenr != ws->fragend)
-        ws->nfrag++;
-    ws->fragend = disk_bytenr + disk_num_bytes;
+    scanned = realloc(scanned, (nscanned + 1) * sizeof(*scanned));
+    if (!scanned)
+        die("Out of memory.\n");
+    scanned[nscanned].root = root;
+    INIT_RADIX_TREE(&scanned[nscanned].inodes, 0);
+    return &scanned[nscanned++].inodes;
 }
 
-static void do_file(int fd, ino_t st_ino, struct workspace *ws, const char *filename)
+static void mark_scanned(int fd, dev_t dev, ino_t st_ino)
 {
-    static struct btrfs_sv2_args sv2_args;
-    struct btrfs_ioctl_search_header *head;
-    uint32_t nr_items, hlen;
-    uint8_t *bp;
+    if (fs_fd == -1 && (fs_fd = dup(fd)) == -1)
+        die("dup: %m\n");
 
-    DPRINTF("inode = %" PRIu64"\n", st_ino);
-    ws->nfiles++;
-    ws->fragend = -1;
+    radix_begin();
+    radix_tree_insert(root_inodes(file_root(fd, dev)), st_ino, (void *)st_ino);
+    radix_end();
+}
 
-    init_sv2_args(st_ino, &sv2_args);
+// Looked up by both the traversal and, with --pipeline, the parser.
+static struct watch_root **watch_roots;
+static int nwatch_roots;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct watched_file *cur_watch; // the file being parsed
 
-again:
-    if (ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, &sv2_args))
+static struct watch_root *find_watch_root(uint64_t root, int create)
+{
+    struct watch_root *wr = 0;
+    int i;
+
+    pthread_mutex_lock(&watch_lock);
+    for (i = 0; i < nwatch_roots; i++)
+        if (watch_roots[i]->root == root)
+            wr = watch_roots[i];
+    if (!wr && create)
     {
-        if (errno == ENOTTY)
-            die("%s: Not btrfs (or SEARCH_V2 unsupported).\n", filename);
-        else
-            die("%s: SEARCH_V2: %m\n", filename);
+        watch_roots = realloc(watch_roots, (nwatch_roots + 1) * sizeof(*watch_roots));
+        wr = calloc(1, sizeof(*wr));
+        if (!watch_roots || !wr)
+            die("Out of memory.\n");
+        wr->root = root;
+        wr->fd = -1;
+        INIT_RADIX_TREE(&wr->files, 0);
+        INIT_RADIX_TREE(&wr->dirs, 0);
+        watch_roots[nwatch_roots++] = wr;
     }
+    pthread_mutex_unlock(&watch_lock);
+    return wr;
+}
 
-    nr_items = sv2_args.key.nr_items;
-    DPRINTF("nr_items = %u\n", nr_items);
+// The subvolume fd is in, keeping a copy of fd to search it from later if
+// it's the first we see of that subvolume (maybe a file given directly).
+static uint64_t watch_fd(int fd, dev_t dev)
+{
+    uint64_t root = file_root(fd, dev);
+    struct watch_root *wr = find_watch_root(root, 1);
 
-    bp = sv2_args.buf;
-    for (; nr_items > 0; nr_items--, bp += hlen)
-    {
-        head = (struct btrfs_ioctl_search_header*)bp;
-        hlen = get_unaligned_32(&head->len);
-        DPRINTF("{ transid=%lu objectid=%lu offset=%lu type=%u len=%u }\n",
-		get_unaligned_64(&head->transid),
-		get_unaligned_64(&head->objectid),
-		get_unaligned_64(&head->offset),
-		get_unaligned_32(&head->type),
-		hlen);
-        bp += sizeof(*head);
+    if (wr->fd == -1 && (wr->fd = dup(fd)) == -1)
+        die("dup: %m\n");
+    return root;
+}
 
-        parse_file_extent_item(bp, hlen, ws, filename);
-    }
+static void watch_ref(struct extent_rec *rec, uint64_t disk, uint64_t num_bytes,
+                      unsigned comp_type, int frag)
+{
+    struct watched_file *w = cur_watch;
+    struct watch_ref *r;
 
-    // Will be exactly 197379 (16MB/85) on overflow, but let's play it safe.
-    // In theory, we're supposed to retry until getting 0, but RTFK says
-    // there are no short reads (just running out of buffer space), so we
-    // avoid having to search twice.
-    if (sv2_args.key.nr_items > 512)
+    if (w->n >= w->alloc)
     {
-        sv2_args.key.nr_items = -1;
-        sv2_args.key.min_offset = get_unaligned_64(&head->offset) + 1;
-        goto again;
+        w->alloc = w->alloc ? w->alloc * 2 : 4;
+        w->refs = realloc(w->refs, w->alloc * sizeof(*w->refs));
+        if (!w->refs)
+            die("Out of memory.\n");
     }
+    r = &w->refs[w->n++];
+    r->rec = rec;
+    r->disk = disk;
+    r->num_bytes = num_bytes;
+    r->comp_type = comp_type;
+    r->frag = frag;
 }
 
-static void do_recursive_search(const char *path, struct workspace *ws, const dev_t *dev)
+// Takes a file's contribution back out of the totals, dropping extents
+// nothing else references any more.
+static void unwatch_file(struct workspace *ws, struct watch_root *wr,
+                         struct watched_file *w)
 {
-        int fd;
-        int path_size;
-        char *fn;
-        DIR *dir;
-        struct dirent *de;
-        struct stat st;
-
-        if (sig_stats)
-        {
-            sig_stats = 0;
-            print_stats(ws);
-        }
+    struct extent_rec *rec;
+    struct watch_ref *r;
+    size_t i;
 
-        fd = open(path, O_RDONLY|O_NOFOLLOW|O_NOCTTY|O_NONBLOCK);
-        if (fd == -1)
+    for (i = 0; i < w->n; i++)
+    {
+        r = &w->refs[i];
+        if (!(rec = r->rec))
         {
-            if (errno == ELOOP    // symlink
-             || errno == ENXIO    // some device nodes
-             || errno == ENODEV   // /dev/ptmx
-             || errno == ENOMEDIUM// more device nodes
-             || errno == ENOENT)  // something just deleted
-                return; // ignore, silently
-            else if (errno == EACCES)
-            {
-                fprintf(stderr, "%s: %m\n", path);
-                return; // warn
-            }
-            else
-                die("open(\"%s\"): %m\n", path);
+            ws->disk[r->comp_type] -= r->disk;
+            ws->uncomp[r->comp_type] -= r->num_bytes;
+            ws->refd[r->comp_type] -= r->num_bytes;
+            ws->ninline--;
+            ws->nfrag--;
+            continue;
         }
+        ws->refd[r->comp_type] -= r->num_bytes;
+        ws->nrefs--;
+        ws->nfrag -= r->frag;
+        rec->refd -= r->num_bytes;
+        if (--rec->refs)
+            continue;
+        ws->disk[rec->comp_type] -= rec->disk;
+        ws->uncomp[rec->comp_type] -= rec->uncomp;
+        ws->nextents--;
+        radix_begin();
+        radix_tree_delete(&ws->seen_extents, rec->bytenr >> 12);
+        radix_end();
+        free(rec->bookend);
+        free_extent_rec(rec);
+    }
+    if (w->counted)
+        ws->nfiles--;
+    radix_begin();
+    radix_tree_delete(&wr->files, w->ino);
+    radix_end();
+    free(w->refs);
+    free(w);
+}
 
-        DPRINTF("%s\n", path);
-
-        if (fstat(fd, &st))
-            die("stat(\"%s\"): %m\n", path);
+// Starts recording a file's contribution, replacing any earlier one.
+static void watch_file(struct workspace *ws, uint64_t root, uint64_t ino)
+{
+    struct watch_root *wr = find_watch_root(root, 1);
+    struct watched_file *w;
 
-        if (opt_one_fs && dev != NULL && *dev != st.st_dev)
-            return;
+    if ((w = radix_tree_lookup(&wr->files, ino)))
+        unwatch_file(ws, wr, w);
+    if (!(w = calloc(1, sizeof(*w))))
+        die("Out of memory.\n");
+    w->ino = ino;
+    radix_begin();
+    radix_tree_insert(&wr->files, ino, w);
+    radix_end();
+    cur_watch = w;
+}
 
-        if (S_ISDIR(st.st_mode))
-        {
-            dir = fdopendir(fd);
-            if (!dir)
-                die("opendir(\"%s\"): %m\n", path);
-            path_size = 2; // slash + \0;
-            path_size += strlen(path) + NAME_MAX;
-            fn = (char *) malloc(path_size);
-            if (!fn)
-                die("Out of memory.\n");
-            while(1)
-            {
-                    de = readdir(dir);
-                    if (!de)
-                        break;
-                    if (de->d_type != DT_DIR
-                     && de->d_type != DT_REG
-                     && de->d_type != DT_UNKNOWN)
-                    {
-                        continue;
-                    }
-                    if (!strcmp(de->d_name, "."))
-                        continue;
-                    if (!strcmp(de->d_name, ".."))
-                        continue;
-                    const char *slash = strrchr(path, '/');
-                    snprintf(fn, path_size, (slash && !slash[1]) ? "%s%s"
-                        : "%s/%s", path, de->d_name);
-                    do_recursive_search(fn, ws, &st.st_dev);
-            }
-            free(fn);
-            closedir(dir);
-        }
+static int add_group(const char *label, uint64_t root)
+{
+    if (ngroups >= MAX_GROUPS)
+        die("Can't compare more than %d %s.\n", MAX_GROUPS,
+            opt_share_matrix == 's' ? "subvolumes" : "arguments");
+    groups[ngroups].label = strdup(label);
+    groups[ngroups].root = root;
+    return ngroups++;
+}
 
-        if (S_ISREG(st.st_mode))
-            do_file(fd, st.st_ino, ws, path);
+static int subvol_group(int fd, dev_t dev, const char *path)
+{
+    uint64_t root = file_root(fd, dev);
+    int i;
 
-        close(fd);
+    for (i = 0; i < ngroups; i++)
+        if (groups[i].root == root)
+            return i;
+    return add_group(path, root);
 }
 
-#define HB 24 /* size of buffers */
-static void human_bytes(uint64_t x, char *output)
+static inline int is_hole(uint64_t disk_bytenr)
 {
-    static const char *units = "BKMGTPE";
-    int u = 0;
-
-    if (opt_bytes)
-        return (void)snprintf(output, HB, "%"PRIu64, x);
+    return disk_bytenr == 0;
+}
 
-    while (x >= 10240)
-        u++, x>>=10;
-    if (x >= 1024)
-        snprintf(output, HB, " %"PRIu64".%"PRIu64"%c", x>>10, x*10/1024%10, units[u+1]);
-    else
-        snprintf(output, HB, "%4"PRIu64"%c", x, units[u]);
+static void add_inline(struct workspace *ws, unsigned comp_type,
+                       uint64_t disk_num_bytes, uint64_t ram_bytes)
+{
+    ws->disk[comp_type] += disk_num_bytes;
+    ws->uncomp[comp_type] += ram_bytes;
+    ws->refd[comp_type] += ram_bytes;
+    ws->ninline++;
+    ws->nfrag++;
 }
 
-static void print_table(const char *type,
-                        const char *percentage,
-                        const char *disk_usage,
-                        const char *uncomp_usage,
-                        const char *refd_usage)
+static void add_extent(struct workspace *ws, unsigned comp_type,
+                       uint64_t disk_num_bytes, uint64_t ram_bytes)
 {
-        printf("%-10s %-8s %-12s %-12s %-12s\n", type, percentage,
-               disk_usage, uncomp_usage, refd_usage);
+    ws->disk[comp_type] += disk_num_bytes;
+    ws->uncomp[comp_type] += ram_bytes;
+    ws->nextents++;
 }
 
-static void print_help(void)
+static void add_ref(struct workspace *ws, unsigned comp_type,
+                    uint64_t num_bytes, int frag)
 {
-        fprintf(stderr,
-		"Usage: compsize [options] file-or-dir1 [file-or-dir2 ...]\n"
-		"\n"
-		"Compsize displays total space used by set of files, taking into account\n"
-		"compression, reflinks, partially overwritten extents.\n"
-		"\n"
-		"Options:\n"
-		"    -h, --help              print this help message and exit\n"
-		"    -b, --bytes             display raw bytes instead of human-readable sizes\n"
-		"    -x, --one-file-system   don't cross filesystem boundaries\n"
-		"\n"
-	);
+    ws->refd[comp_type] += num_bytes;
+    ws->nrefs++;
+    ws->nfrag += frag;
 }
 
-static void parse_options(int argc, char **argv)
+static uint32_t file_name(struct file_stats *file, const char *filename)
 {
-    static const char *short_options = "bxh";
-    static struct option long_options[] =
+    if (file->name)
+        return file->name;
+    if (nfile_names >= file_names_alloc)
     {
-        {"bytes",                  0, 0, 'b'},
-        {"one-file-system",        0, 0, 'x'},
+        file_names_alloc = file_names_alloc ? file_names_alloc * 2 : 256;
+        file_names = realloc(file_names, file_names_alloc * sizeof(*file_names));
+        if (!file_names)
+            die("Out of memory.\n");
+    }
+    if (!(file_names[nfile_names++] = strdup(filename)))
+        die("Out of memory.\n");
+    return file->name = nfile_names;
+}
+
+// Adds [start, end) to what's referenced of the extent, merging ranges that
+// overlap or touch; once that's all of it, there's nothing more to track.
+static void add_bookend_ref(struct extent_rec *rec, uint64_t start, uint64_t end,
+                            struct file_stats *file, const char *filename)
+{
+    struct bookend *be = rec->bookend;
+    uint32_t i, j;
+
+    if (rec->flags & EXT_COVERED)
+        return;
+    if (!be && start == 0 && end >= rec->uncomp)
+    {
+        rec->flags |= EXT_COVERED;
+        return;
+    }
+
+    if (!be || be->n >= be->alloc)
+    {
+        uint32_t alloc = be ? be->alloc * 2 : 2;
+        be = realloc(be, sizeof(*be) + alloc * sizeof(be->r[0]));
+        if (!be)
+            die("Out of memory.\n");
+        if (!rec->bookend)
+        {
+            be->n = 0;
+            be->owner = file_name(file, filename);
+        }
+        be->alloc = alloc;
+        rec->bookend = be;
+    }
+
+    for (i = 0; i < be->n && be->r[i].end < start; i++)
+        ;
+    for (j = i; j < be->n && be->r[j].start <= end; j++)
+    {
+        if (be->r[j].start < start)
+            start = be->r[j].start;
+        if (be->r[j].end > end)
+            end = be->r[j].end;
+    }
+    // r[i..j) are merged into one
+    memmove(&be->r[i + 1], &be->r[j], (be->n - j) * sizeof(be->r[0]));
+    be->n += 1 - (j - i);
+    be->r[i].start = start;
+    be->r[i].end = end;
+
+    if (be->n == 1 && start == 0 && end >= rec->uncomp)
+    {
+        rec->flags |= EXT_COVERED;
+        rec->bookend = 0;
+        free(be);
+    }
+}
+
+// Names (directories, extensions) to whatever a report keeps for them.
+struct name_map
+{
+        struct name_slot
+        {
+                char *name;
+                void *value;
+        } *slots;
+        size_t n, size;
+};
+
+static uint64_t hash_name(const char *s, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL; // FNV-1a
+
+    while (len--)
+        h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    return h;
+}
+
+// Finds the value for the first len bytes of name; a new one is made by
+// calling alloc.
+static void *name_map_get(struct name_map *m, const char *name, size_t len,
+                          void *(*alloc)(void))
+{
+    struct name_slot *old;
+    size_t i, size;
+
+    if (m->n * 2 >= m->size)
+    {
+        old = m->slots;
+        size = m->size;
+        m->size = size ? size * 2 : 256;
+        m->slots = calloc(m->size, sizeof(*m->slots));
+        if (!m->slots)
+            die("Out of memory.\n");
+        for (m->n = 0; size--;)
+            if (old[size].name)
+            {
+                i = hash_name(old[size].name, strlen(old[size].name)) & (m->size - 1);
+                while (m->slots[i].name)
+                    i = (i + 1) & (m->size - 1);
+                m->slots[i] = old[size];
+                m->n++;
+            }
+        free(old);
+    }
+
+    i = hash_name(name, len) & (m->size - 1);
+    for (; m->slots[i].name; i = (i + 1) & (m->size - 1))
+        if (!strncmp(m->slots[i].name, name, len) && !m->slots[i].name[len])
+            return m->slots[i].value;
+
+    if (!(m->slots[i].name = strndup(name, len)))
+        die("Out of memory.\n");
+    m->slots[i].value = alloc();
+    m->n++;
+    return m->slots[i].value;
+}
+
+// Lower-cased suffix of the file name, without the dot; "" if none.
+static const char *file_ext(const char *path, char buf[16])
+{
+    const char *base = strrchr(path, '/');
+    const char *dot;
+    int i;
+
+    base = base ? base + 1 : path;
+    dot = strrchr(base, '.');
+    if (!dot || dot == base || strlen(dot + 1) >= 16)
+        return "";
+    for (i = 0; dot[i + 1]; i++)
+        buf[i] = tolower((unsigned char)dot[i + 1]);
+    buf[i] = 0;
+    return buf;
+}
+
+// --estimate: how well uncompressed data would compress.  Blocks of newly
+// seen uncompressed extents are sampled during the scan; afterwards worker
+// threads read them back and try each compressor, rounding the result up
+// to sectors and giving up on blocks that don't shrink, as btrfs does.
+#define EST_BLOCK       131072 // btrfs compresses up to 128K at a time
+
+#ifdef HAVE_ZLIB
+static size_t est_zlib(const void *in, size_t len, void *out, size_t cap, void *work)
+{
+    uLongf n = cap;
+
+    return compress2(out, &n, in, len, 3) == Z_OK ? n : len;
+}
+#endif
+
+#ifdef HAVE_LZO
+static size_t est_lzo(const void *in, size_t len, void *out, size_t cap, void *work)
+{
+    lzo_uint n = cap;
+
+    return lzo1x_1_compress(in, len, out, &n, work) == LZO_E_OK ? n : len;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static size_t est_zstd(const void *in, size_t len, void *out, size_t cap, void *work)
+{
+    size_t n = ZSTD_compress(out, cap, in, len, 3);
+
+    return ZSTD_isError(n) ? len : n;
+}
+#endif
+
+// Levels are btrfs' defaults.
+static const struct estimator
+{
+        const char *name;
+        size_t (*compress)(const void *in, size_t len, void *out, size_t cap,
+                           void *work);
+} estimators[] = {
+#ifdef HAVE_ZLIB
+        { "zlib", est_zlib },
+#endif
+#ifdef HAVE_LZO
+        { "lzo", est_lzo },
+#endif
+#ifdef HAVE_ZSTD
+        { "zstd", est_zstd },
+#endif
+        { 0 }
+};
+
+#define NEST (ARRAY_SIZE(estimators) - 1)
+#define EST_MAX 3
+
+// Per directory or extension: disk usage of uncompressed extents first
+// seen there, and what the sampled blocks compressed to.
+struct est_group
+{
+        uint64_t disk;
+        uint64_t in, out[EST_MAX];
+};
+
+struct est_sample
+{
+        uint32_t file; // in file_names, + 1
+        uint32_t len;
+        uint64_t offset;
+        struct est_group *dir, *ext;
+        uint64_t out[EST_MAX];
+};
+
+static struct est_sample *samples;
+static size_t nsamples, samples_alloc;
+static struct name_map est_dirs, est_exts;
+static uint64_t est_disk; // of all uncompressed regular extents
+static uint64_t est_bw; // bytes/s, 0 = unlimited
+static uint64_t est_bw_next;
+static pthread_mutex_t est_bw_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *new_est_group(void)
+{
+    void *g = calloc(1, sizeof(struct est_group));
+
+    if (!g)
+        die("Out of memory.\n");
+    return g;
+}
+
+// Is this block in the sample?  Decided by position, so that reruns
+// pick the same blocks.
+static int est_sampled(uint64_t bytenr, uint64_t offset)
+{
+    uint64_t h = (bytenr + offset) * 0x9E3779B97F4A7C15ULL;
+
+    return (h >> 40) < (uint64_t)(opt_estimate * (1 << 24) / 100);
+}
+
+static void add_est_extent(struct workspace *ws, const struct btrfs_file_extent_item *ei,
+                           uint64_t file_offset, const char *filename)
+{
+    uint64_t disk_bytenr = get_unaligned_le64(&ei->disk_bytenr);
+    uint64_t offset = get_unaligned_le64(&ei->offset);
+    uint64_t num_bytes = get_unaligned_le64(&ei->num_bytes);
+    struct est_sample *s;
+    const char *slash;
+    char buf[16];
+    uint64_t b;
+
+    if (!ws->file.est_dir)
+    {
+        slash = strrchr(filename, '/');
+        ws->file.est_dir = name_map_get(&est_dirs, filename,
+                                        slash ? slash - filename : 0, new_est_group);
+        ws->file.est_ext = name_map_get(&est_exts, file_ext(filename, buf),
+                                        strlen(file_ext(filename, buf)), new_est_group);
+    }
+    ws->file.est_dir->disk += get_unaligned_le64(&ei->disk_num_bytes);
+    ws->file.est_ext->disk += get_unaligned_le64(&ei->disk_num_bytes);
+    est_disk += get_unaligned_le64(&ei->disk_num_bytes);
+
+    for (b = 0; b < num_bytes; b += EST_BLOCK)
+    {
+        if (!est_sampled(disk_bytenr, offset + b))
+            continue;
+        if (nsamples >= samples_alloc)
+        {
+            samples_alloc = samples_alloc ? samples_alloc * 2 : 1024;
+            samples = realloc(samples, samples_alloc * sizeof(*samples));
+            if (!samples)
+                die("Out of memory.\n");
+        }
+        s = &samples[nsamples++];
+        memset(s, 0, sizeof(*s));
+        s->file = file_name(&ws->file, filename);
+        s->offset = file_offset + b;
+        s->len = num_bytes - b < EST_BLOCK ? num_bytes - b : EST_BLOCK;
+        s->dir = ws->file.est_dir;
+        s->ext = ws->file.est_ext;
+    }
+}
+
+// --by-owner: totals per uid or gid, each extent charged to the owner of
+// the first file found using it.
+struct owner_stats
+{
+        uint64_t nfiles;
+        uint64_t disk, uncomp, refd;
+        uint64_t shared; // of disk, also used by other owners' files
+};
+
+static struct name_map owners; // by decimal id
+static struct owner_stats *cur_owner;
+
+static void *new_owner(void)
+{
+    struct owner_stats *o = calloc(1, sizeof(*o));
+
+    if (!o)
+        die("Out of memory.\n");
+    return o;
+}
+
+static void set_owner(const struct inode_info *ii)
+{
+    char id[12];
+
+    snprintf(id, sizeof(id), "%u", opt_owner == 'g' ? ii->gid : ii->uid);
+    cur_owner = name_map_get(&owners, id, strlen(id), new_owner);
+    cur_owner->nfiles++;
+}
+
+// --by-extension: totals per file name extension and compression type,
+// extents charged to the first file found using them.
+struct ext_type
+{
+        unsigned type;
+        uint64_t disk, uncomp, refd;
+};
+
+struct ext_stats
+{
+        uint64_t disk;
+        int ntypes;
+        struct ext_type *types;
+};
+
+static struct name_map exts;
+static struct ext_stats *cur_ext;
+
+static void *new_ext(void)
+{
+    struct ext_stats *e = calloc(1, sizeof(*e));
+
+    if (!e)
+        die("Out of memory.\n");
+    return e;
+}
+
+static struct ext_type *ext_type(struct ext_stats *e, unsigned type)
+{
+    int i;
+
+    for (i = 0; i < e->ntypes; i++)
+        if (e->types[i].type == type)
+            return &e->types[i];
+    e->types = realloc(e->types, (e->ntypes + 1) * sizeof(*e->types));
+    if (!e->types)
+        die("Out of memory.\n");
+    memset(&e->types[i], 0, sizeof(*e->types));
+    e->types[i].type = type;
+    e->ntypes++;
+    return &e->types[i];
+}
+
+static void add_ext(unsigned type, uint64_t disk, uint64_t uncomp, uint64_t refd)
+{
+    struct ext_type *et = ext_type(cur_ext, type);
+
+    et->disk += disk;
+    et->uncomp += uncomp;
+    et->refd += refd;
+    cur_ext->disk += disk;
+}
+
+// --read-amp: reading any part of a compressed extent means decompressing
+// all of it, so a reference costs ram_bytes for its num_bytes; others cost
+// just what they reference.
+static uint64_t amp_ram[MAX_ENTRIES], amp_refd[MAX_ENTRIES], amp_refs[MAX_ENTRIES];
+static double amp_worst[MAX_ENTRIES];
+
+struct amp_file
+{
+        char *path;
+        uint64_t extra; // decompressed beyond what's referenced
+        double avg, worst;
+};
+
+static struct amp_file *amp_files; // min-heap on extra
+static int namp_files;
+
+static void add_read_amp(struct file_stats *fs, unsigned comp_type,
+                         uint64_t ram_bytes, uint64_t num_bytes)
+{
+    uint64_t cost = comp_type && comp_type != PREALLOC ? ram_bytes : num_bytes;
+    double amp;
+
+    if (!num_bytes)
+        return;
+    amp = (double)cost / num_bytes;
+    amp_ram[comp_type] += cost;
+    amp_refd[comp_type] += num_bytes;
+    amp_refs[comp_type]++;
+    if (amp > amp_worst[comp_type])
+        amp_worst[comp_type] = amp;
+    fs->amp_ram += cost;
+    fs->amp_refd += num_bytes;
+    if (amp > fs->amp_worst)
+        fs->amp_worst = amp;
+}
+
+static void amp_sift_down(int i)
+{
+    struct amp_file tmp;
+    int c;
+
+    while ((c = 2 * i + 1) < namp_files)
+    {
+        if (c + 1 < namp_files && amp_files[c + 1].extra < amp_files[c].extra)
+            c++;
+        if (amp_files[i].extra <= amp_files[c].extra)
+            break;
+        tmp = amp_files[i];
+        amp_files[i] = amp_files[c];
+        amp_files[c] = tmp;
+        i = c;
+    }
+}
+
+// Keeps the opt_read_amp files with the most extra decompression.
+static void add_amp_file(const struct file_stats *fs, const char *path)
+{
+    struct amp_file *af;
+    struct amp_file tmp;
+    int i;
+
+    if (fs->amp_ram <= fs->amp_refd)
+        return;
+    if (!amp_files && !(amp_files = calloc(opt_read_amp, sizeof(*amp_files))))
+        die("Out of memory.\n");
+    if (namp_files == opt_read_amp)
+    {
+        if (fs->amp_ram - fs->amp_refd <= amp_files[0].extra)
+            return;
+        free(amp_files[0].path);
+        af = &amp_files[0];
+    }
+    else
+        af = &amp_files[namp_files++];
+    af->extra = fs->amp_ram - fs->amp_refd;
+    af->avg = (double)fs->amp_ram / fs->amp_refd;
+    af->worst = fs->amp_worst;
+    if (!(af->path = strdup(path)))
+        die("Out of memory.\n");
+
+    if (af == &amp_files[0])
+        amp_sift_down(0);
+    else
+        for (i = namp_files - 1; i && amp_files[(i - 1) / 2].extra > amp_files[i].extra;
+             i = (i - 1) / 2)
+        {
+            tmp = amp_files[i];
+            amp_files[i] = amp_files[(i - 1) / 2];
+            amp_files[(i - 1) / 2] = tmp;
+        }
+}
+
+// --per-file: the current file's extent refs, consolidated into a record
+// when it ends.  Only ever one file's worth.
+struct file_ref
+{
+        uint64_t bytenr; // 0 for inline
+        uint64_t disk, uncomp, refd;
+        unsigned comp_type;
+};
+
+static struct file_ref *file_refs;
+static size_t nfile_refs, file_refs_alloc;
+static FILE *per_file_out;
+
+static void add_file_ref(uint64_t bytenr, uint64_t disk, uint64_t uncomp,
+                         uint64_t refd, unsigned comp_type, int same)
+{
+    struct file_ref *r;
+
+    if (same && nfile_refs)
+    {
+        file_refs[nfile_refs - 1].refd += refd;
+        return;
+    }
+    if (nfile_refs >= file_refs_alloc)
+    {
+        file_refs_alloc = file_refs_alloc ? file_refs_alloc * 2 : 1024;
+        file_refs = realloc(file_refs, file_refs_alloc * sizeof(*file_refs));
+        if (!file_refs)
+            die("Out of memory.\n");
+    }
+    r = &file_refs[nfile_refs++];
+    r->bytenr = bytenr;
+    r->disk = disk;
+    r->uncomp = uncomp;
+    r->refd = refd;
+    r->comp_type = comp_type;
+}
+
+static int cmp_file_ref(const void *a, const void *b)
+{
+    const struct file_ref *x = a, *y = b;
+
+    return x->bytenr < y->bytenr ? -1 : x->bytenr > y->bytenr;
+}
+
+static const char *type_name(int t, char buf[12]);
+
+// disk, uncomp, refd, extents, fragments, dominant type (by referenced
+// bytes), path; tab-separated, path last so that only the terminator
+// needs to be unambiguous.
+static void print_file_record(const struct file_stats *fs, const char *path)
+{
+    static uint64_t type_refd[MAX_ENTRIES];
+    uint64_t disk = 0, uncomp = 0, nextents = 0;
+    char unkn_comp[12];
+    const char *type = "-";
+    int best = -1;
+    size_t i;
+
+    if (nfile_refs > 1)
+        qsort(file_refs, nfile_refs, sizeof(*file_refs), cmp_file_ref);
+    for (i = 0; i < nfile_refs; i++)
+    {
+        const struct file_ref *r = &file_refs[i];
+
+        type_refd[r->comp_type] += r->refd;
+        if (r->bytenr && i && r->bytenr == file_refs[i - 1].bytenr)
+            continue; // the same extent again
+        disk += r->disk;
+        uncomp += r->uncomp;
+        nextents++;
+    }
+    for (i = 0; i < nfile_refs; i++)
+    {
+        unsigned t = file_refs[i].comp_type;
+        if (best == -1 || type_refd[t] > type_refd[best])
+            best = t;
+    }
+    for (i = 0; i < nfile_refs; i++)
+        type_refd[file_refs[i].comp_type] = 0;
+    if (best != -1)
+        type = type_name(best, unkn_comp);
+    nfile_refs = 0;
+
+    fprintf(per_file_out, "%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64
+            "\t%s\t%s%c", disk, uncomp, fs->refd, nextents, fs->nfrag, type, path,
+            opt_print0 ? '\0' : '\n');
+}
+
+static void parse_file_extent_item(uint8_t *bp, uint32_t hlen, uint64_t file_offset,
+                                   struct workspace *ws, const char *filename)
+{
+    struct btrfs_file_extent_item *ei;
+    struct extent_rec *rec = 0;
+    uint64_t disk_num_bytes, ram_bytes, disk_bytenr, num_bytes;
+    uint32_t inline_header_sz;
+    unsigned  comp_type;
+
+    DPRINTF("len=%u\n", hlen);
+
+    ei = (struct btrfs_file_extent_item *) bp;
+
+    ram_bytes = get_unaligned_le64(&ei->ram_bytes);
+    comp_type = ei->compression;
+
+    if (ei->type == BTRFS_FILE_EXTENT_INLINE)
+    {
+        inline_header_sz  = sizeof(*ei);
+        inline_header_sz -= sizeof(ei->disk_bytenr);
+        inline_header_sz -= sizeof(ei->disk_num_bytes);
+        inline_header_sz -= sizeof(ei->offset);
+        inline_header_sz -= sizeof(ei->num_bytes);
+
+        disk_num_bytes = hlen-inline_header_sz;
+        DPRINTF("inline: ram_bytes=%lu compression=%u disk_num_bytes=%lu\n",
+             ram_bytes, comp_type, disk_num_bytes);
+        add_inline(ws, comp_type, disk_num_bytes, ram_bytes);
+        if (ws->group)
+            add_inline(ws->group, comp_type, disk_num_bytes, ram_bytes);
+        ws->file.refd += ram_bytes;
+        ws->file.nfrag++;
+        ws->fragend = -1;
+        if (per_file_out)
+            add_file_ref(0, disk_num_bytes, ram_bytes, ram_bytes, comp_type, 0);
+        if (cur_owner)
+        {
+            cur_owner->disk += disk_num_bytes;
+            cur_owner->uncomp += ram_bytes;
+            cur_owner->refd += ram_bytes;
+        }
+        if (cur_ext)
+            add_ext(comp_type, disk_num_bytes, ram_bytes, ram_bytes);
+        if (cur_watch)
+            watch_ref(0, disk_num_bytes, ram_bytes, comp_type, 1);
+        return;
+    }
+
+    if (ei->type == BTRFS_FILE_EXTENT_PREALLOC)
+        comp_type = PREALLOC;
+
+    if (hlen != sizeof(*ei))
+    {
+        fail("%s: Regular extent's header not 53 bytes (%u) long?!?\n", filename, hlen);
+        return;
+    }
+
+    disk_num_bytes = get_unaligned_le64(&ei->disk_num_bytes);
+    disk_bytenr = get_unaligned_le64(&ei->disk_bytenr);
+    num_bytes = get_unaligned_le64(&ei->num_bytes);
+
+    if (is_hole(disk_bytenr))
+        return;
+
+    DPRINTF("regular: ram_bytes=%lu compression=%u disk_num_bytes=%lu disk_bytenr=%lu\n",
+         ram_bytes, comp_type, disk_num_bytes, disk_bytenr);
+
+    if (!IS_ALIGNED(disk_bytenr, 1 << 12))
+    {
+        fail("%s: Extent not 4K-aligned at %"PRIu64"?!?\n", filename, disk_bytenr);
+        return;
+    }
+
+    unsigned long pageno = disk_bytenr >> 12;
+    int is_new, is_new_in_group = 0, frag;
+    radix_begin();
+    if (opt_extent_recs)
+    {
+        rec = radix_tree_lookup(&ws->seen_extents, pageno);
+        if ((is_new = !rec))
+        {
+            rec = new_extent_rec();
+            rec->bytenr = disk_bytenr;
+            rec->disk = disk_num_bytes;
+            rec->uncomp = ram_bytes;
+            rec->comp_type = comp_type;
+            rec->generation = get_unaligned_le64(&ei->generation);
+            rec->owner = cur_owner;
+            radix_tree_insert(&ws->seen_extents, pageno, rec);
+        }
+        rec->refd += num_bytes;
+        rec->refs++;
+        is_new_in_group = !(rec->groups & 1ULL << cur_group);
+        rec->groups |= 1ULL << cur_group;
+    }
+    else
+        is_new = radix_tree_insert(&ws->seen_extents, pageno, (void *)pageno) == 0;
+    radix_end();
+    if (is_new)
+    {
+        add_extent(ws, comp_type, disk_num_bytes, ram_bytes);
+        if (opt_estimate && comp_type == 0) // none
+            add_est_extent(ws, ei, file_offset, filename);
+    }
+    if (is_new_in_group && ws->group)
+        add_extent(ws->group, comp_type, disk_num_bytes, ram_bytes);
+
+    frag = disk_bytenr != ws->fragend;
+    add_ref(ws, comp_type, num_bytes, frag);
+    if (ws->group)
+        add_ref(ws->group, comp_type, num_bytes, frag);
+    ws->file.refd += num_bytes;
+    ws->file.nfrag += frag;
+    if (per_file_out)
+        add_file_ref(disk_bytenr, disk_num_bytes, ram_bytes, num_bytes, comp_type,
+                     disk_bytenr + disk_num_bytes == ws->fragend);
+    ws->fragend = disk_bytenr + disk_num_bytes;
+    if (cur_watch)
+        watch_ref(rec, 0, num_bytes, comp_type, frag);
+    if (cur_owner && rec)
+    {
+        if (is_new)
+        {
+            cur_owner->disk += disk_num_bytes;
+            cur_owner->uncomp += ram_bytes;
+        }
+        else if (rec->owner != cur_owner)
+            rec->flags |= EXT_OWNERS;
+        cur_owner->refd += num_bytes;
+    }
+    if (cur_ext)
+        add_ext(comp_type, is_new ? disk_num_bytes : 0, is_new ? ram_bytes : 0,
+                num_bytes);
+    if (opt_read_amp)
+        add_read_amp(&ws->file, comp_type, ram_bytes, num_bytes);
+    if (opt_bookend && rec)
+    {
+        uint64_t offset = get_unaligned_le64(&ei->offset);
+        add_bookend_ref(rec, offset, offset + num_bytes, &ws->file, filename);
+    }
+}
+
+static void add_frag_entry(const struct file_stats *fs, const char *filename)
+{
+    struct frag_entry *fe;
+
+    if (fs->nfrag < opt_frag_min || !fs->refd)
+        return;
+
+    if (frag_count >= frag_alloc)
+    {
+        frag_alloc = frag_alloc ? frag_alloc * 2 : 1024;
+        frag_list = realloc(frag_list, frag_alloc * sizeof(*frag_list));
+        if (!frag_list)
+            die("Out of memory.\n");
+    }
+
+    fe = &frag_list[frag_count++];
+    fe->nfrag = fs->nfrag;
+    fe->bytes = fs->refd;
+    fe->path = strdup(filename);
+    if (!fe->path)
+        die("Out of memory.\n");
+}
+
+static void parse_inode_item(uint8_t *bp, uint32_t hlen, struct inode_info *ii,
+                             const char *filename)
+{
+    struct btrfs_inode_item *item;
+
+    if (hlen < sizeof(*item))
+    {
+        fail("%s: Inode item too short (%u)?!?\n", filename, hlen);
+        return;
+    }
+
+    item = (struct btrfs_inode_item *) bp;
+    ii->generation = get_unaligned_le64(&item->generation);
+    ii->transid    = get_unaligned_le64(&item->transid);
+    ii->ctime      = get_unaligned_le64(&item->ctime.sec);
+    ii->size       = get_unaligned_le64(&item->size);
+    ii->flags      = get_unaligned_le64(&item->flags);
+    ii->nlink      = get_unaligned_le32(&item->nlink);
+    ii->uid        = get_unaligned_le32(&item->uid);
+    ii->gid        = get_unaligned_le32(&item->gid);
+    ii->mode       = get_unaligned_le32(&item->mode);
+    DPRINTF("inode: mode=%o size=%lu nlink=%u flags=%lx\n",
+            ii->mode, ii->size, ii->nlink, ii->flags);
+}
+
+static void count_file(struct workspace *ws)
+{
+    ws->nfiles++;
+    if (ws->group)
+        ws->group->nfiles++;
+    // --by-owner implies --inode-items, so we know whose it is by now.
+    if (opt_owner)
+        set_owner(&ws->file.inode);
+}
+
+// With --pipeline, it's the consumer thread that prints.
+static void check_sig_stats(struct workspace *ws)
+{
+    if (sig_stats && !pipe_line)
+    {
+        sig_stats = 0;
+        print_stats(ws);
+    }
+}
+
+// A checkpoint can only be taken between directories.  If the one being
+// scanned doesn't finish within a couple of seconds of SIGTERM/SIGINT,
+// stop anyway, leaving the last checkpoint (if any) to resume from.
+static void check_interrupt(void)
+{
+    static time_t deadline;
+
+    if (!sig_checkpoint || !opt_checkpoint)
+        return;
+    if (!deadline)
+        deadline = time(0) + 2;
+    else if (time(0) >= deadline)
+    {
+        fprintf(stderr, "Interrupted; continue from the last checkpoint with "
+                "--resume --checkpoint=%s\n", opt_checkpoint);
+        exit(1);
+    }
+}
+
+// Files searched together: their inode numbers, ascending, and paths.
+// Freed by the parser once it's done with the last buffer.
+struct file_batch
+{
+        int group;
+        uint64_t root; // --watch
+        size_t n;
+        uint64_t *ino;
+        size_t *path; // offsets into paths
+        char *paths;
+};
+
+static struct file_batch *new_batch(size_t n, size_t paths_len)
+{
+    struct file_batch *b;
+
+    b = malloc(sizeof(*b) + n * (sizeof(*b->ino) + sizeof(*b->path)) + paths_len);
+    if (!b)
+        die("Out of memory.\n");
+    b->n = n;
+    b->root = 0;
+    b->ino = (uint64_t *)(b + 1);
+    b->path = (size_t *)(b->ino + n);
+    b->paths = (char *)(b->path + n);
+    return b;
+}
+
+static inline const char *batch_path(const struct file_batch *b, size_t k)
+{
+    return b->paths + b->path[k];
+}
+
+// One search result, with what's needed to account it without the
+// traversal's state, so a separate thread can do that (--pipeline).
+struct search_buf
+{
+        struct btrfs_sv2_args sv2_args;
+        int flags;
+        struct file_batch *batch;
+};
+
+#define SB_FIRST        1 // first buffer of a batch
+#define SB_LAST         2 // and/or its last one
+#define SB_STOP         4 // no more files
+
+// Buffers cycle from the free list to the queue, and back once parsed.
+struct pipeline
+{
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        struct search_buf **free;
+        int nfree;
+        struct search_buf **queue;
+        int head, count, size;
+        pthread_t consumer;
+        struct workspace *ws;
+};
+
+static struct search_buf *get_search_buf(void)
+{
+    static struct search_buf *sb;
+    struct pipeline *pl = pipe_line;
+
+    if (!pl)
+    {
+        if (!sb && !(sb = malloc(sizeof(*sb))))
+            die("Out of memory.\n");
+        return sb;
+    }
+
+    pthread_mutex_lock(&pl->lock);
+    while (!pl->nfree)
+        pthread_cond_wait(&pl->cond, &pl->lock);
+    sb = pl->free[--pl->nfree];
+    pthread_mutex_unlock(&pl->lock);
+    return sb;
+}
+
+static void put_search_buf(struct search_buf *sb)
+{
+    struct pipeline *pl = pipe_line;
+
+    if (!pl)
+        return;
+    pthread_mutex_lock(&pl->lock);
+    pl->free[pl->nfree++] = sb;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+static void parse_search_buf(struct search_buf *sb, struct workspace *ws);
+
+static void submit_search_buf(struct search_buf *sb, struct workspace *ws)
+{
+    struct pipeline *pl = pipe_line;
+
+    if (!pl)
+        return parse_search_buf(sb, ws);
+
+    pthread_mutex_lock(&pl->lock);
+    pl->queue[(pl->head + pl->count++) % pl->size] = sb;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+static void *pipeline_consumer(void *arg)
+{
+    struct pipeline *pl = arg;
+    struct search_buf *sb;
+
+    while (1)
+    {
+        pthread_mutex_lock(&pl->lock);
+        while (!pl->count)
+            pthread_cond_wait(&pl->cond, &pl->lock);
+        sb = pl->queue[pl->head];
+        pl->head = (pl->head + 1) % pl->size;
+        pl->count--;
+        pthread_mutex_unlock(&pl->lock);
+
+        if (sb->flags & SB_STOP)
+            return 0;
+        parse_search_buf(sb, pl->ws);
+        put_search_buf(sb);
+        if (sig_stats)
+        {
+            sig_stats = 0;
+            print_stats(pl->ws);
+        }
+    }
+}
+
+static void start_pipeline(int nbufs, struct workspace *ws)
+{
+    struct pipeline *pl;
+    int i;
+
+    pl = calloc(1, sizeof(*pl));
+    if (!pl)
+        die("Out of memory.\n");
+    pthread_mutex_init(&pl->lock, 0);
+    pthread_cond_init(&pl->cond, 0);
+    pl->size = nbufs;
+    pl->free = calloc(nbufs, sizeof(*pl->free));
+    pl->queue = calloc(nbufs, sizeof(*pl->queue));
+    if (!pl->free || !pl->queue)
+        die("Out of memory.\n");
+    for (i = 0; i < nbufs; i++)
+        if (!(pl->free[pl->nfree++] = malloc(sizeof(struct search_buf))))
+            die("Out of memory.\n");
+    pl->ws = ws;
+    pipe_line = pl;
+    if (pthread_create(&pl->consumer, 0, pipeline_consumer, pl))
+        die("pthread_create: %m\n");
+}
+
+// Waits until the consumer has parsed everything queued so far.
+static void drain_pipeline(void)
+{
+    struct pipeline *pl = pipe_line;
+
+    if (!pl)
+        return;
+    pthread_mutex_lock(&pl->lock);
+    while (pl->nfree < pl->size)
+        pthread_cond_wait(&pl->cond, &pl->lock);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+// Waits until everything queued has been accounted for.
+static void stop_pipeline(void)
+{
+    struct pipeline *pl = pipe_line;
+    struct search_buf *sb;
+
+    sb = get_search_buf();
+    sb->flags = SB_STOP;
+    submit_search_buf(sb, pl->ws);
+    pthread_join(pl->consumer, 0);
+    pipe_line = 0;
+    while (pl->nfree)
+        free(pl->free[--pl->nfree]);
+    free(pl->free);
+    free(pl->queue);
+    free(pl);
+}
+
+// --age=time: a transaction and when it happened, from inodes' ctime.
+struct age_anchor
+{
+        uint64_t transid;
+        int64_t time;
+};
+
+static struct age_anchor *anchors;
+static size_t nanchors, anchors_alloc;
+
+static void add_age_anchor(uint64_t transid, int64_t time)
+{
+    if (!time)
+        return;
+    if (nanchors >= anchors_alloc)
+    {
+        anchors_alloc = anchors_alloc ? anchors_alloc * 2 : 4096;
+        anchors = realloc(anchors, anchors_alloc * sizeof(*anchors));
+        if (!anchors)
+            die("Out of memory.\n");
+    }
+    anchors[nanchors].transid = transid;
+    anchors[nanchors].time = time;
+    nanchors++;
+}
+
+// Where the consumer is within a batch; survives from buffer to buffer.
+static struct
+{
+        struct file_batch *batch;
+        size_t k;       // index of the current file
+        int open;       // items so far belong to batch->ino[k]
+        int skip;       // which isn't a regular file
+} cur_file;
+
+static void begin_file(struct workspace *ws, size_t k)
+{
+    cur_file.k = k;
+    cur_file.open = 1;
+    cur_file.skip = 0;
+    if (opt_watch)
+        watch_file(ws, cur_file.batch->root, cur_file.batch->ino[k]);
+    if (!opt_inode_items)
+    {
+        count_file(ws);
+        if (cur_watch)
+            cur_watch->counted = 1;
+    }
+    ws->fragend = -1;
+    cur_owner = 0;
+    memset(&ws->file, 0, sizeof(ws->file));
+    if (opt_by_ext)
+    {
+        char buf[16];
+        const char *ext = file_ext(batch_path(cur_file.batch, k), buf);
+
+        cur_ext = name_map_get(&exts, ext, strlen(ext), new_ext);
+    }
+}
+
+static void end_file(struct workspace *ws)
+{
+    if (!cur_file.open)
+        return;
+    cur_file.open = 0;
+    // No inode item: the file got deleted since readdir().
+    if (cur_file.skip || (opt_inode_items && !ws->file.inode.mode))
+    {
+        nfile_refs = 0;
+        if (cur_watch)
+            unwatch_file(ws, find_watch_root(cur_file.batch->root, 0), cur_watch);
+        cur_watch = 0;
+        return;
+    }
+    cur_watch = 0;
+    if (opt_frag_report)
+        add_frag_entry(&ws->file, batch_path(cur_file.batch, cur_file.k));
+    if (per_file_out)
+        print_file_record(&ws->file, batch_path(cur_file.batch, cur_file.k));
+    if (opt_read_amp)
+        add_amp_file(&ws->file, batch_path(cur_file.batch, cur_file.k));
+}
+
+static void parse_search_buf(struct search_buf *sb, struct workspace *ws)
+{
+    struct file_batch *b = sb->batch;
+    struct btrfs_ioctl_search_header *head;
+    uint32_t nr_items, hlen, type;
+    uint64_t objectid;
+    uint8_t *bp;
+
+    if (sb->flags & SB_FIRST)
+    {
+        cur_file.batch = b;
+        cur_file.open = 0;
+        cur_file.k = 0;
+        cur_group = b->group;
+        ws->group = groups[cur_group].ws;
+        // Without inode items, even a file that has no extents counts.
+        if (!opt_inode_items)
+            begin_file(ws, 0);
+    }
+
+    nr_items = sb->sv2_args.key.nr_items;
+    DPRINTF("nr_items = %u\n", nr_items);
+
+    bp = sb->sv2_args.buf;
+    for (; nr_items > 0; nr_items--, bp += hlen)
+    {
+        head = (struct btrfs_ioctl_search_header*)bp;
+        hlen = get_unaligned_32(&head->len);
+        type = get_unaligned_32(&head->type);
+        objectid = get_unaligned_64(&head->objectid);
+        DPRINTF("{ transid=%lu objectid=%lu offset=%lu type=%u len=%u }\n",
+		get_unaligned_64(&head->transid),
+		objectid,
+		get_unaligned_64(&head->offset),
+		type,
+		hlen);
+        bp += sizeof(*head);
+
+        // Items come sorted by inode; those between the batch's files
+        // (other directories' files) are skipped.
+        if (!cur_file.open || objectid != b->ino[cur_file.k])
+        {
+            end_file(ws);
+            while (cur_file.k < b->n && b->ino[cur_file.k] < objectid)
+                cur_file.k++;
+            if (cur_file.k == b->n || b->ino[cur_file.k] != objectid)
+                continue;
+            begin_file(ws, cur_file.k);
+        }
+        if (cur_file.skip)
+            continue;
+
+        if (type == BTRFS_EXTENT_DATA_KEY)
+            parse_file_extent_item(bp, hlen, get_unaligned_64(&head->offset), ws,
+                                   batch_path(b, cur_file.k));
+        else if (type == BTRFS_INODE_ITEM_KEY)
+        {
+            parse_inode_item(bp, hlen, &ws->file.inode, batch_path(b, cur_file.k));
+            if (!S_ISREG(ws->file.inode.mode))
+            {
+                cur_file.skip = 1;
+                continue;
+            }
+            count_file(ws);
+            if (cur_watch)
+                cur_watch->counted = 1;
+            if (opt_age == 't')
+                add_age_anchor(ws->file.inode.transid, ws->file.inode.ctime);
+        }
+    }
+
+    if (sb->flags & SB_LAST)
+    {
+        end_file(ws);
+        free(b);
+    }
+}
+
+// In theory, we're supposed to retry until getting 0, but RTFK says
+// there are no short reads (just running out of buffer space), so we
+// avoid having to search twice unless the next item might not have fit.
+// Sets up the key for the next search if there's need for one.
+static int search_continues(struct btrfs_sv2_args *sv2_args,
+                            struct btrfs_ioctl_search_key *next)
+{
+    struct btrfs_ioctl_search_header *head = 0;
+    uint32_t nr_items = sv2_args->key.nr_items;
+    uint8_t *bp = sv2_args->buf;
+
+    for (; nr_items > 0; nr_items--)
+    {
+        head = (struct btrfs_ioctl_search_header*)bp;
+        bp += sizeof(*head) + get_unaligned_32(&head->len);
+    }
+
+    if (!head || sizeof(sv2_args->buf) - (bp - sv2_args->buf) >= MAX_ITEM_SIZE)
+        return 0;
+
+    *next = sv2_args->key;
+    next->nr_items = -1;
+    next->min_objectid = get_unaligned_64(&head->objectid);
+    next->min_type = get_unaligned_32(&head->type);
+    next->min_offset = get_unaligned_64(&head->offset) + 1;
+    return 1;
+}
+
+// Counts what a search found, and how much of it belonged to inodes
+// that merely lie in the batch's key range.
+static void count_items(const struct btrfs_sv2_args *sv2_args,
+                        const struct file_batch *b)
+{
+    const struct btrfs_ioctl_search_header *head;
+    uint32_t nr_items = sv2_args->key.nr_items;
+    const uint8_t *bp = sv2_args->buf;
+    uint64_t objectid;
+    size_t k = 0;
+
+    scan_stats.items += nr_items;
+    for (; nr_items > 0; nr_items--)
+    {
+        head = (const struct btrfs_ioctl_search_header*)bp;
+        bp += sizeof(*head) + get_unaligned_32(&head->len);
+        objectid = get_unaligned_64(&head->objectid);
+        while (k < b->n && b->ino[k] < objectid)
+            k++;
+        if (k == b->n || b->ino[k] != objectid)
+            scan_stats.foreign++;
+    }
+}
+
+// Throttling, for scanning a busy machine: fixed caps on searches and
+// opens per second, and/or a delay between searches that grows while
+// they take longer than --target-latency (a sign the disks are busy) and
+// shrinks back when they don't.
+struct rate_limit
+{
+        uint64_t interval; // ns, 0 = unlimited
+        uint64_t next;
+};
+
+static struct rate_limit search_rate, open_rate;
+static uint64_t target_latency, search_latency, search_delay;
+static unsigned search_window; // searches since search_delay last changed
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+    struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+}
+
+static void rate_wait(struct rate_limit *rl)
+{
+    uint64_t now;
+
+    if (!rl->interval)
+        return;
+    now = now_ns();
+    if (rl->next > now)
+    {
+        sleep_ns(rl->next - now);
+        now = rl->next;
+    }
+    rl->next = now + rl->interval;
+}
+
+static void search_throttle(void)
+{
+    rate_wait(&search_rate);
+    if (search_delay)
+        sleep_ns(search_delay);
+}
+
+// Feeds one search's latency into the moving average and adjusts the delay,
+// at most once per 8 searches: about what the average takes to show the
+// effect of the last change.
+static void search_done(uint64_t latency)
+{
+    if (!target_latency)
+        return;
+    search_latency = search_latency ? (search_latency * 7 + latency) / 8 : latency;
+    if (search_delay && ++search_window < 8)
+        return;
+    search_window = 0;
+    if (search_latency > target_latency)
+        search_delay = !search_delay ? 1000000 // 1ms
+                     : search_delay < 500000000 ? search_delay * 2 : 1000000000;
+    else
+        search_delay = search_delay / 2 < 10000 ? 0 : search_delay / 2;
+}
+
+// Idle I/O priority and CPU scheduling: only run when nothing else wants to.
+static void go_idle(void)
+{
+    struct sched_param sp = { 0 };
+
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT))
+        fprintf(stderr, "ioprio_set: %m\n");
+    if (sched_setscheduler(0, SCHED_IDLE, &sp))
+        fprintf(stderr, "sched_setscheduler: %m\n");
+}
+
+// Group of the argument being traversed, for --per-arg/--share-matrix.
+static int scan_group;
+
+// FIEMAP, for unprivileged scans.  It doesn't say an extent's compression
+// type nor its size on disk, only that it's "encoded", and where its data
+// starts: the disk location for compressed extents, and for plain ones that
+// plus the offset into the extent, so partial references to one extent
+// look like different extents.  Adjacent extents may also get merged.
+// Results go through parse_file_extent_item() like searched ones, as if
+// file extent items, with these approximations:
+//  * encoded extents get a type of their own, counted once per start;
+//  * their disk size is the distance to the next encoded extent of the
+//    same file (compressed extents written in one go are laid out back to
+//    back), at most the referenced length;
+//  * plain extents are deduplicated by where the referenced part starts.
+#define FIEMAP_EXTENTS  512
+#define FIEMAP_ENCODED  255 // not a real compression type (yet)
+
+static struct fiemap *fiemap_buf;
+static struct fiemap_extent *file_fes;
+static size_t nfile_fes, file_fes_alloc;
+static uint64_t *encoded_starts;
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void fiemap_file(int fd, const char *path, struct workspace *ws)
+{
+    uint8_t item[sizeof(struct btrfs_file_extent_item)];
+    struct btrfs_file_extent_item *ei = (void *)item;
+    struct fiemap_extent *fe;
+    uint64_t start = 0, disk, *next;
+    size_t i, nencoded = 0;
+    uint32_t inline_header_sz;
+
+    if (!fiemap_buf && !(fiemap_buf = malloc(sizeof(*fiemap_buf)
+                                   + FIEMAP_EXTENTS * sizeof(*fiemap_buf->fm_extents))))
+        die("Out of memory.\n");
+    nfile_fes = 0;
+    do
+    {
+        memset(fiemap_buf, 0, sizeof(*fiemap_buf));
+        fiemap_buf->fm_start = start;
+        fiemap_buf->fm_length = FIEMAP_MAX_OFFSET - start;
+        fiemap_buf->fm_extent_count = FIEMAP_EXTENTS;
+        scan_stats.searches++;
+        search_throttle();
+        if (ioctl(fd, FS_IOC_FIEMAP, fiemap_buf))
+        {
+            fail("%s: FIEMAP: %m\n", path);
+            return;
+        }
+        if (!fiemap_buf->fm_mapped_extents)
+            break;
+        if (nfile_fes + fiemap_buf->fm_mapped_extents > file_fes_alloc)
+        {
+            file_fes_alloc = (nfile_fes + fiemap_buf->fm_mapped_extents) * 2;
+            file_fes = realloc(file_fes, file_fes_alloc * sizeof(*file_fes));
+            encoded_starts = realloc(encoded_starts, file_fes_alloc * sizeof(*encoded_starts));
+            if (!file_fes || !encoded_starts)
+                die("Out of memory.\n");
+        }
+        memcpy(file_fes + nfile_fes, fiemap_buf->fm_extents,
+               fiemap_buf->fm_mapped_extents * sizeof(*file_fes));
+        nfile_fes += fiemap_buf->fm_mapped_extents;
+        fe = &file_fes[nfile_fes - 1];
+        start = fe->fe_logical + fe->fe_length;
+    } while (!(fe->fe_flags & FIEMAP_EXTENT_LAST));
+
+    for (i = 0; i < nfile_fes; i++)
+        if ((file_fes[i].fe_flags & (FIEMAP_EXTENT_ENCODED|FIEMAP_EXTENT_DATA_INLINE))
+            == FIEMAP_EXTENT_ENCODED)
+            encoded_starts[nencoded++] = file_fes[i].fe_physical;
+    if (nencoded)
+        qsort(encoded_starts, nencoded, sizeof(*encoded_starts), cmp_u64);
+
+    inline_header_sz = offsetof(struct btrfs_file_extent_item, disk_bytenr);
+    for (i = 0; i < nfile_fes; i++)
+    {
+        fe = &file_fes[i];
+        if (fe->fe_flags & (FIEMAP_EXTENT_DELALLOC|FIEMAP_EXTENT_UNKNOWN))
+            continue; // no place on disk yet
+        memset(item, 0, sizeof(item));
+        ei->compression = fe->fe_flags & FIEMAP_EXTENT_ENCODED ? FIEMAP_ENCODED : 0;
+        put_unaligned_le64(fe->fe_length, &ei->ram_bytes);
+        if (fe->fe_flags & FIEMAP_EXTENT_DATA_INLINE)
+        {
+            ei->type = BTRFS_FILE_EXTENT_INLINE;
+            parse_file_extent_item(item, inline_header_sz + fe->fe_length,
+                                   fe->fe_logical, ws, path);
+            continue;
+        }
+        disk = fe->fe_length;
+        if (ei->compression)
+        {
+            next = bsearch(&fe->fe_physical, encoded_starts, nencoded,
+                           sizeof(*encoded_starts), cmp_u64);
+            for (; next && next < encoded_starts + nencoded; next++)
+                if (*next > fe->fe_physical)
+                {
+                    if (*next - fe->fe_physical < disk)
+                        disk = *next - fe->fe_physical;
+                    break;
+                }
+        }
+        ei->type = fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN ? BTRFS_FILE_EXTENT_PREALLOC
+                                                          : BTRFS_FILE_EXTENT_REG;
+        put_unaligned_le64(fe->fe_physical, &ei->disk_bytenr);
+        put_unaligned_le64(disk, &ei->disk_num_bytes);
+        put_unaligned_le64(fe->fe_length, &ei->num_bytes);
+        parse_file_extent_item(item, sizeof(item), fe->fe_logical, ws, path);
+    }
+}
+
+static int open_entry(const char *path);
+
+// The FIEMAP counterpart of the searches: file by file, each from its own
+// descriptor; the parser's bookkeeping (begin_file() etc) done in line.
+static void fiemap_batch(int fd, struct file_batch *b, struct workspace *ws)
+{
+    struct stat st;
+    size_t k;
+    int ffd;
+
+    drain_pipeline(); // from before we switched, if any
+    cur_file.batch = b;
+    cur_group = b->group;
+    ws->group = groups[cur_group].ws;
+    for (k = 0; k < b->n; k++)
+    {
+        // A lone file's own descriptor, else the directory's.
+        if (b->n == 1 && !opt_inode_items)
+            ffd = fd;
+        else if ((ffd = open_entry(batch_path(b, k))) == -1)
+            continue;
+        begin_file(ws, k);
+        if (opt_inode_items)
+        {
+            // What the inode item would have said, as far as stat() knows.
+            if (fstat(ffd, &st))
+                fail("stat(\"%s\"): %m\n", batch_path(b, k));
+            else if (S_ISREG(st.st_mode))
+            {
+                ws->file.inode.size = st.st_size;
+                ws->file.inode.nlink = st.st_nlink;
+                ws->file.inode.uid = st.st_uid;
+                ws->file.inode.gid = st.st_gid;
+                ws->file.inode.mode = st.st_mode;
+                ws->file.inode.ctime = st.st_ctime;
+                count_file(ws);
+            }
+            else
+                cur_file.skip = 1;
+        }
+        if (!cur_file.skip && (!opt_inode_items || ws->file.inode.mode))
+            fiemap_file(ffd, batch_path(b, k), ws);
+        end_file(ws);
+        if (ffd != fd)
+            close(ffd);
+    }
+    free(b);
+}
+
+static void use_fiemap(void)
+{
+    opt_fiemap = 1;
+    comp_types[FIEMAP_ENCODED] = "encoded";
+}
+
+// Searches the whole inode range of a batch at once, handing each buffer
+// of results to the parser.  fd may be any file or directory in the same
+// subvolume as the batch.
+static void search_batch(int fd, dev_t dev, struct file_batch *b,
+                         struct workspace *ws)
+{
+    struct btrfs_ioctl_search_key next;
+    struct search_buf *sb;
+    int flags = SB_FIRST;
+    uint64_t start;
+    size_t i;
+
+    check_sig_stats(ws);
+    check_interrupt();
+    if (opt_exclusive)
+        for (i = 0; i < b->n; i++)
+            mark_scanned(fd, dev, b->ino[i]);
+    else if (opt_layout && fs_fd == -1 && (fs_fd = dup(fd)) == -1)
+        die("dup: %m\n");
+    b->group = scan_group;
+    if (opt_watch && !b->root)
+        b->root = watch_fd(fd, dev);
+    if (opt_share_matrix == 's')
+        b->group = subvol_group(fd, dev, batch_path(b, 0));
+
+    scan_stats.files += b->n;
+    if (opt_fiemap)
+    {
+        fiemap_batch(fd, b, ws);
+        return;
+    }
+    sb = get_search_buf();
+    init_sv2_args(b->ino[0], b->ino[b->n - 1], &sb->sv2_args);
+
+again:
+    scan_stats.searches++;
+    search_throttle();
+    start = target_latency ? now_ns() : 0;
+    if (ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, &sb->sv2_args))
+    {
+        if (errno == ENOTTY)
+            die("%s: Not btrfs (or SEARCH_V2 unsupported).\n", batch_path(b, 0));
+        if (errno == EPERM && (flags & SB_FIRST))
+        {
+            // Rescans name their batches by inode, FIEMAP needs paths.
+            if (opt_watch)
+                die("%s: SEARCH_V2: %m, and --watch can't use FIEMAP.\n",
+                    batch_path(b, 0));
+            fprintf(stderr, "SEARCH_V2 needs root, falling back to FIEMAP.\n");
+            if (opt_age)
+            {
+                fprintf(stderr, "FIEMAP doesn't tell generations, no --age table.\n");
+                opt_age = 0;
+            }
+            use_fiemap();
+            put_search_buf(sb);
+            fiemap_batch(fd, b, ws);
+            return;
+        }
+        fail("%s: SEARCH_V2: %m\n", batch_path(b, 0));
+        if (flags & SB_FIRST)
+        {
+            put_search_buf(sb);
+            free(b);
+            return;
+        }
+        // Close the batch with what we have.
+        sb->sv2_args.key.nr_items = 0;
+        sb->flags = flags | SB_LAST;
+        sb->batch = b;
+        submit_search_buf(sb, ws);
+        return;
+    }
+    if (target_latency)
+        search_done(now_ns() - start);
+
+    count_items(&sb->sv2_args, b);
+    if (!search_continues(&sb->sv2_args, &next))
+        flags |= SB_LAST;
+    sb->flags = flags;
+    sb->batch = b;
+    submit_search_buf(sb, ws);
+
+    if (!(flags & SB_LAST))
+    {
+        flags = 0;
+        sb = get_search_buf();
+        sb->sv2_args.key = next;
+        sb->sv2_args.buf_size = sizeof(sb->sv2_args.buf);
+        goto again;
+    }
+}
+
+static void do_file(int fd, ino_t st_ino, dev_t dev, struct workspace *ws,
+                    const char *filename)
+{
+    struct file_batch *b;
+
+    DPRINTF("inode = %" PRIu64"\n", st_ino);
+    b = new_batch(1, strlen(filename) + 1);
+    b->ino[0] = st_ino;
+    b->path[0] = 0;
+    strcpy(b->paths, filename);
+    search_batch(fd, dev, b, ws);
+}
+
+// Decide whether to skip a directory entry, before it gets opened.  Only
+// the name is needed unless there are size or mtime bounds, and even then
+// just an fstatat() of regular files.  Excluded directories are pruned
+// along with everything below them.
+// --exclude patterns with a slash are matched against the path from the
+// argument's parent on (".git/objects" when scanning ".git"), and at any
+// depth below; anchored ones (leading slash) against the absolute path:
+// for a relative argument, its real path followed by the rest.
+static char *anchor_abs;
+static size_t anchor_len, anchor_base;
+
+static void set_anchor(const char *arg)
+{
+    size_t len;
+
+    if (!filt.nslashed)
+        return;
+    anchor_len = strlen(arg);
+    while (anchor_len > 1 && arg[anchor_len - 1] == '/')
+        anchor_len--;
+    free(anchor_abs);
+    if (arg[0] == '/' || !(anchor_abs = realpath(arg, 0)))
+    {
+        if (!(anchor_abs = strndup(arg, anchor_len)))
+            die("Out of memory.\n");
+    }
+    len = strlen(anchor_abs);
+    while (len > 1 && anchor_abs[len - 1] == '/')
+        anchor_abs[--len] = 0;
+    for (anchor_base = len; anchor_base && anchor_abs[anchor_base - 1] != '/';)
+        anchor_base--;
+}
+
+// Returns the absolute path, and in *rel the part of it from the
+// argument's parent on.
+static const char *anchored_path(const char *path, const char **rel)
+{
+    static char buf[PATH_MAX];
+    const char *rest = path + anchor_len;
+    size_t len = strlen(anchor_abs);
+
+    while (*rest == '/')
+        rest++;
+    if (len + 1 + strlen(rest) >= sizeof(buf))
+    {
+        *rel = path;
+        return path;
+    }
+    memcpy(buf, anchor_abs, len);
+    if (anchor_abs[len - 1] != '/')
+        buf[len++] = '/';
+    strcpy(buf + len, rest);
+    *rel = buf + anchor_base;
+    return buf;
+}
+
+// Whether pat matches the path, or its tail after any slash.
+static int match_tail(const char *pat, const char *path)
+{
+    for (;;)
+    {
+        if (!fnmatch(pat, path, 0))
+            return 1;
+        if (!(path = strchr(path, '/')))
+            return 0;
+        path++;
+    }
+}
+
+static int skip_entry(DIR *dir, const char *path, const struct dirent *de)
+{
+    const char *abs = 0, *rel = 0;
+    struct stat st;
+    int i;
+
+    for (i = 0; i < filt.nexclude; i++)
+    {
+        if (!strchr(filt.exclude[i], '/'))
+        {
+            if (!fnmatch(filt.exclude[i], de->d_name, 0))
+                return 1;
+            continue;
+        }
+        if (!abs)
+            abs = anchored_path(path, &rel);
+        if (filt.exclude[i][0] == '/' ? !fnmatch(filt.exclude[i], abs, 0)
+                                      : match_tail(filt.exclude[i], rel))
+            return 1;
+    }
+    for (i = 0; i < filt.nexclude_re; i++)
+        if (!regexec(&filt.exclude_re[i], path, 0, 0, 0))
+            return 1;
+
+    if (de->d_type == DT_DIR)
+        return 0;
+
+    // DT_UNKNOWN only on filesystems that don't fill d_type (not btrfs).
+    if (filt.need_stat || (de->d_type == DT_UNKNOWN && filt.nname))
+    {
+        if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+            return 0; // let open() report it
+        if (!S_ISREG(st.st_mode))
+            return 0;
+        if ((uint64_t)st.st_size < filt.min_size
+         || (uint64_t)st.st_size > filt.max_size)
+            return 1;
+        if (st.st_mtime < filt.newer || (filt.older && st.st_mtime > filt.older))
+            return 1;
+    }
+
+    if (!filt.nname)
+        return 0;
+    for (i = 0; i < filt.nname; i++)
+        if (!fnmatch(filt.name[i], de->d_name, 0))
+            return 0;
+    return 1;
+}
+
+// Directories still to be scanned; a stack, so the walk stays depth-first
+// without holding a descriptor open for every level.
+struct pending_dir
+{
+        char *path;
+        dev_t dev;
+        int top; // a command-line argument: no parent device to compare
+};
+
+static struct pending_dir *pending;
+static size_t npending, pending_alloc;
+
+static void push_dir(char *path, dev_t dev, int top)
+{
+    if (npending >= pending_alloc)
+    {
+        pending_alloc = pending_alloc ? pending_alloc * 2 : 64;
+        pending = realloc(pending, pending_alloc * sizeof(*pending));
+        if (!pending)
+            die("Out of memory.\n");
+    }
+    pending[npending].path = path;
+    pending[npending].dev = dev;
+    pending[npending].top = top;
+    npending++;
+}
+
+// One directory's worth of entries, read fully before any is searched.
+struct dir_entries
+{
+        struct dir_ent
+        {
+                uint64_t ino;
+                size_t name;
+                unsigned char type;
+        } *ent;
+        size_t n, alloc;
+        char *names;
+        size_t names_len, names_alloc;
+};
+
+static void add_dir_ent(struct dir_entries *de, const struct dirent *d)
+{
+    size_t len = strlen(d->d_name) + 1;
+
+    if (de->n >= de->alloc)
+    {
+        de->alloc = de->alloc ? de->alloc * 2 : 256;
+        de->ent = realloc(de->ent, de->alloc * sizeof(*de->ent));
+        if (!de->ent)
+            die("Out of memory.\n");
+    }
+    while (de->names_len + len > de->names_alloc)
+    {
+        de->names_alloc = de->names_alloc ? de->names_alloc * 2 : 8192;
+        de->names = realloc(de->names, de->names_alloc);
+        if (!de->names)
+            die("Out of memory.\n");
+    }
+    memcpy(de->names + de->names_len, d->d_name, len);
+    de->ent[de->n].ino = d->d_ino;
+    de->ent[de->n].name = de->names_len;
+    de->ent[de->n].type = d->d_type;
+    de->names_len += len;
+    de->n++;
+}
+
+static int cmp_dir_ent(const void *a, const void *b)
+{
+    uint64_t x = ((const struct dir_ent *)a)->ino;
+    uint64_t y = ((const struct dir_ent *)b)->ino;
+
+    return x < y ? -1 : x > y;
+}
+
+static int open_entry(const char *path)
+{
+        int fd;
+
+        rate_wait(&open_rate);
+        fd = open(path, O_RDONLY|O_NOFOLLOW|O_NOCTTY|O_NONBLOCK);
+        if (fd == -1)
+        {
+            if (errno == ELOOP    // symlink
+             || errno == ENXIO    // some device nodes
+             || errno == ENODEV   // /dev/ptmx
+             || errno == ENOMEDIUM// more device nodes
+             || errno == ENOENT)  // something just deleted
+                return -1; // ignore, silently
+            else if (errno == EACCES)
+            {
+                fprintf(stderr, "%s: %m\n", path);
+                return -1; // warn
+            }
+            fail("open(\"%s\"): %m\n", path);
+            return -1;
+        }
+        return fd;
+}
+
+// With --inode-items, a directory's regular files are searched from its
+// own handle, several at a time: one search covers a run of files whose
+// inode numbers are close, skipping what lies between.  The items of
+// inodes in between come along, so a run ends at a subdirectory (its
+// entries) or once it spans BATCH_GAP other inode numbers; and once a
+// search brings back mostly other inodes' items anyway (big files), the
+// directory's remaining files go one by one.
+#define BATCH_FILES     1024
+#define BATCH_GAP       64
+
+static void do_dir_files(DIR *dir, const char *path, const char *fmt,
+                         dev_t dev, const struct dir_entries *de,
+                         struct workspace *ws)
+{
+    size_t i, j, k, n, len, plen = strlen(path) + 2;
+    struct file_batch *b;
+    uint64_t last, gap, max_gap = BATCH_GAP, items, foreign;
+
+    for (i = 0; i < de->n; i = j)
+    {
+        j = i + 1;
+        if (de->ent[i].type != DT_REG)
+            continue;
+        n = 1;
+        len = plen + strlen(de->names + de->ent[i].name);
+        last = de->ent[i].ino;
+        gap = 0;
+        for (; j < de->n && n < BATCH_FILES; j++)
+        {
+            if (de->ent[j].type != DT_REG || de->ent[j].ino <= last)
+                break;
+            gap += de->ent[j].ino - last - 1;
+            if (gap > max_gap)
+                break;
+            n++;
+            len += plen + strlen(de->names + de->ent[j].name);
+            last = de->ent[j].ino;
+        }
+
+        b = new_batch(n, len);
+        for (k = i, n = 0, len = 0; k < j; k++)
+        {
+            b->ino[n] = de->ent[k].ino;
+            b->path[n++] = len;
+            len += sprintf(b->paths + len, fmt, path,
+                           de->names + de->ent[k].name) + 1;
+        }
+        items = scan_stats.items;
+        foreign = scan_stats.foreign;
+        search_batch(dirfd(dir), dev, b, ws);
+        if ((scan_stats.foreign - foreign) * 2 > scan_stats.items - items)
+            max_gap = 0;
+    }
+}
+
+static void do_entry(char *path, struct workspace *ws, const dev_t *dev);
+
+// Remembers a directory, to notice files created in it (--watch).
+static void watch_dir(int fd, const struct stat *st, const char *path)
+{
+    struct watch_root *wr = find_watch_root(watch_fd(fd, st->st_dev), 0);
+    char *old, *p;
+
+    if (!(p = strdup(path)))
+        die("Out of memory.\n");
+    radix_begin();
+    if ((old = radix_tree_delete(&wr->dirs, st->st_ino)))
+        free(old);
+    radix_tree_insert(&wr->dirs, st->st_ino, p);
+    radix_end();
+}
+
+// Reads the whole directory, then searches its files in inode number
+// order: the fs tree is keyed by inode, so consecutive searches land on
+// the same or adjacent leaves instead of wherever readdir() order (hash
+// of the name) sends them.  Subdirectories are queued, in that order too.
+static void scan_dir(int fd, const char *path, const struct stat *st,
+                     struct workspace *ws)
+{
+        // Not static: do_entry() below recurses back here if a file has
+        // been replaced by a directory since it was read.
+        struct dir_entries de = { 0 };
+        size_t i, path_size;
+        struct dirent *d;
+        char *fn;
+        DIR *dir;
+
+        dir = fdopendir(fd);
+        if (!dir)
+        {
+            fail("opendir(\"%s\"): %m\n", path);
+            close(fd);
+            return;
+        }
+        scan_stats.dirs++;
+        if (opt_watch)
+            watch_dir(fd, st, path);
+        path_size = 2; // slash + \0;
+        path_size += strlen(path) + NAME_MAX;
+        fn = (char *) malloc(path_size);
+        if (!fn)
+            die("Out of memory.\n");
+        const char *slash = strrchr(path, '/');
+        const char *fmt = (slash && !slash[1]) ? "%s%s" : "%s/%s";
+
+        while ((d = readdir(dir)))
+        {
+                if (d->d_type != DT_DIR
+                 && d->d_type != DT_REG
+                 && d->d_type != DT_UNKNOWN)
+                {
+                    continue;
+                }
+                if (!strcmp(d->d_name, "."))
+                    continue;
+                if (!strcmp(d->d_name, ".."))
+                    continue;
+                snprintf(fn, path_size, fmt, path, d->d_name);
+                if (skip_entry(dir, fn, d))
+                    continue;
+                add_dir_ent(&de, d);
+        }
+        if (!opt_readdir_order && de.n)
+            qsort(de.ent, de.n, sizeof(*de.ent), cmp_dir_ent);
+
+        // Subdirectories go on the stack last to first, to come off in order.
+        for (i = de.n; i-- > 0;)
+        {
+            if (de.ent[i].type == DT_REG)
+                continue;
+            snprintf(fn, path_size, fmt, path, de.names + de.ent[i].name);
+            push_dir(strdup(fn), st->st_dev, 0);
+            if (!pending[npending - 1].path)
+                die("Out of memory.\n");
+        }
+
+        if (opt_inode_items)
+            do_dir_files(dir, path, fmt, st->st_dev, &de, ws);
+        else
+        {
+            for (i = 0; i < de.n; i++)
+            {
+                if (de.ent[i].type != DT_REG)
+                    continue;
+                snprintf(fn, path_size, fmt, path, de.names + de.ent[i].name);
+                do_entry(fn, ws, &st->st_dev);
+            }
+        }
+
+        free(de.ent);
+        free(de.names);
+        free(fn);
+        closedir(dir);
+}
+
+// A file, or a directory to be expanded.
+static void do_entry(char *path, struct workspace *ws, const dev_t *dev)
+{
+        struct stat st;
+        int fd;
+
+        check_sig_stats(ws);
+
+        fd = open_entry(path);
+        if (fd == -1)
+            return;
+
+        DPRINTF("%s\n", path);
+
+        if (fstat(fd, &st))
+        {
+            fail("stat(\"%s\"): %m\n", path);
+            close(fd);
+            return;
+        }
+
+        if (opt_one_fs && dev != NULL && *dev != st.st_dev)
+        {
+            close(fd);
+            return;
+        }
+
+        // Label subvolumes by their top directory (or the argument).
+        if (opt_share_matrix == 's' && S_ISDIR(st.st_mode)
+            && (!dev || st.st_ino == BTRFS_FIRST_FREE_OBJECTID))
+            subvol_group(fd, st.st_dev, path);
+
+        if (S_ISDIR(st.st_mode))
+            return scan_dir(fd, path, &st, ws);
+
+        if (S_ISREG(st.st_mode))
+            do_file(fd, st.st_ino, st.st_dev, ws, path);
+
+        close(fd);
+}
+
+static void maybe_checkpoint(struct workspace *ws);
+
+// Between directories, everything popped so far has been fully scanned:
+// the stack alone says what's left, which is what checkpoints save.
+static void walk_pending(struct workspace *ws)
+{
+        struct pending_dir p;
+
+        while (npending)
+        {
+            if (opt_checkpoint)
+                maybe_checkpoint(ws);
+            p = pending[--npending];
+            if (!p.path)
+                die("Out of memory.\n");
+            do_entry(p.path, ws, p.top ? NULL : &p.dev);
+            free(p.path);
+        }
+}
+
+static void do_recursive_search(const char *path, struct workspace *ws)
+{
+        set_anchor(path);
+        push_dir(strdup(path), 0, 1);
+        walk_pending(ws);
+}
+
+#define HB 24 /* size of buffers */
+static void human_bytes(uint64_t x, char *output)
+{
+    static const char *units = "BKMGTPE";
+    int u = 0;
+
+    if (opt_bytes)
+        return (void)snprintf(output, HB, "%"PRIu64, x);
+
+    while (x >= 10240)
+        u++, x>>=10;
+    if (x >= 1024)
+        snprintf(output, HB, " %"PRIu64".%"PRIu64"%c", x>>10, x*10/1024%10, units[u+1]);
+    else
+        snprintf(output, HB, "%4"PRIu64"%c", x, units[u]);
+}
+
+static void print_table(const char *type,
+                        const char *percentage,
+                        const char *disk_usage,
+                        const char *uncomp_usage,
+                        const char *refd_usage)
+{
+        printf("%-10s %-8s %-12s %-12s %-12s\n", type, percentage,
+               disk_usage, uncomp_usage, refd_usage);
+}
+
+static double frag_density(const struct frag_entry *fe)
+{
+    return fe->nfrag * 1048576.0 / fe->bytes;
+}
+
+static int cmp_frag_entry(const void *a, const void *b)
+{
+    const struct frag_entry *x = a, *y = b;
+    double dx, dy;
+
+    switch (opt_frag_sort)
+    {
+    case 'f':
+        if (x->nfrag != y->nfrag)
+            return x->nfrag < y->nfrag ? 1 : -1;
+        break;
+    case 's':
+        if (x->bytes != y->bytes)
+            return x->bytes < y->bytes ? 1 : -1;
+        break;
+    }
+
+    dx = frag_density(x);
+    dy = frag_density(y);
+    if (dx != dy)
+        return dx < dy ? 1 : -1;
+    return strcmp(x->path, y->path);
+}
+
+// One line per file: fragments, fragments per MiB, referenced bytes, path.
+// Tab-separated with the path last, so it can be fed to cut/xargs as is.
+static void print_frag_report(void)
+{
+    size_t i;
+
+    if (frag_count)
+        qsort(frag_list, frag_count, sizeof(*frag_list), cmp_frag_entry);
+    for (i = 0; i < frag_count; i++)
+    {
+        fprintf(frag_out, "%"PRIu64"\t%.1f\t%"PRIu64"\t%s%c", frag_list[i].nfrag,
+                frag_density(&frag_list[i]), frag_list[i].bytes, frag_list[i].path,
+                opt_print0 ? '\0' : '\n');
+        free(frag_list[i].path);
+    }
+    free(frag_list);
+    if (fflush(frag_out) || ferror(frag_out)
+        || (frag_out != stdout && fclose(frag_out)))
+        die("%s: %m\n", opt_frag_file);
+}
+
+static void print_help(void)
+{
+        fprintf(stderr,
+		"Usage: compsize [options] file-or-dir1 [file-or-dir2 ...]\n"
+		"\n"
+		"Compsize displays total space used by set of files, taking into account\n"
+		"compression, reflinks, partially overwritten extents.\n"
+		"\n"
+		"Options:\n"
+		"    -h, --help              print this help message and exit\n"
+		"    -b, --bytes             display raw bytes instead of human-readable sizes\n"
+		"    -x, --one-file-system   don't cross filesystem boundaries\n"
+		"    -j, --jobs=N            use up to N threads where possible\n"
+		"    --exclusive             also show what is referenced only from this set\n"
+		"    --share-matrix[=subvol] show how much each pair of arguments (or\n"
+		"                            subvolumes) shares\n"
+		"    --share-histogram       show extents by number of references to them\n"
+		"    --bookend[=N]           show data pinned by partly referenced extents,\n"
+		"                            and the N files pinning the most (10)\n"
+		"    --estimate[=PERCENT]    sample uncompressed data (1%%) and estimate how\n"
+		"                            much compression would save\n"
+		"    --estimate-bw=SIZE      read at most SIZE per second for the samples\n"
+		"    --age[=gen|time]        show extents by the generation that wrote them,\n"
+		"                            or by age\n"
+		"    --layout                show raw usage per RAID profile and device, and\n"
+		"                            the block groups holding the data\n"
+		"    --per-file=FILE         write a record per file to FILE (- for stdout,\n"
+		"                            instead of the totals)\n"
+		"    --print0                end --per-file and --frag-report records with\n"
+		"                            NUL, not newline\n"
+		"    --checkpoint=FILE       save progress to FILE every few minutes, and on\n"
+		"                            SIGTERM/SIGINT\n"
+		"    --checkpoint-interval=S seconds between checkpoints (300)\n"
+		"    --resume                continue from the --checkpoint, if any\n"
+		"    --keep-going            report errors about files at the end instead\n"
+		"                            of stopping\n"
+		"    --fiemap                use FIEMAP, which doesn't need root but only\n"
+		"                            gives estimates (automatic without root)\n"
+		"    --by-owner[=uid|gid]    show totals per user or group, each extent\n"
+		"                            charged to the first owner found\n"
+		"    --by-extension[=N]      show totals for the N (20) file extensions using\n"
+		"                            the most disk, and all others\n"
+		"    --read-amp[=N]          show how much reads of compressed data get\n"
+		"                            amplified, and the N (10) worst files\n"
+		"    --per-arg               show totals for each argument, then combined\n"
+		"    --emit-set=FILE         save the extent set, to be combined by --merge\n"
+		"    --merge SET...          show totals for the union of extent set files\n"
+		"    --pipeline[=N]          search in one thread while accounting in another,\n"
+		"                            with N buffers in flight (8)\n"
+		"    --readdir-order         search files in directory order, not by inode\n"
+		"    --scan-stats            report directories, searches and disk reads\n"
+		"    --max-searches=N, --max-opens=N\n"
+		"                            limit tree searches or opens per second\n"
+		"    --target-latency=MS     slow down while searches take longer than this\n"
+		"    --idle                  use idle I/O priority and CPU scheduling\n"
+		"    --watch[=SECONDS]       keep following changes, printing totals every\n"
+		"                            SECONDS (60)\n"
+		"    --inode-items           take file attributes from the tree search rather\n"
+		"                            than opening and stat()ing every file\n"
+		"    --frag-report=FILE      list fragmented files to FILE (- for stdout,\n"
+		"                            instead of the totals), most fragmented first\n"
+		"    --frag-min=N            only list files with at least N fragments (2)\n"
+		"    --frag-sort=KEY         order by density (per MiB), frags or size\n"
+		"    --exclude=PATTERN       skip files and directories matching a glob\n"
+		"    --exclude-regex=RE      skip paths matching an extended regex\n"
+		"    --name=PATTERN          only count files whose name matches a glob\n"
+		"    --min-size=SIZE, --max-size=SIZE\n"
+		"                            only count files within these size bounds\n"
+		"    --newer=AGE, --older=AGE\n"
+		"                            only count files modified within/before AGE\n"
+		"\n"
+	);
+}
+
+static uint64_t parse_size(const char *arg)
+{
+    static const char *units = "KMGTPE";
+    const char *u;
+    char *end;
+    uint64_t x;
+
+    x = strtoull(arg, &end, 0);
+    if (end == arg)
+        die("Invalid size: %s\n", arg);
+    if (*end && (u = strchr(units, toupper(*end))))
+        x <<= 10 * (u - units + 1), end++;
+    if (*end)
+        die("Invalid size: %s\n", arg);
+    return x;
+}
+
+// Seconds, or a number followed by m(inutes), h(ours), d(ays), w(eeks).
+static time_t parse_age(const char *arg)
+{
+    char *end;
+    time_t x;
+
+    x = strtoul(arg, &end, 0);
+    if (end == arg)
+        die("Invalid age: %s\n", arg);
+    switch (*end)
+    {
+    case 'w':
+        x *= 7;
+        // fallthrough
+    case 'd':
+        x *= 24;
+        // fallthrough
+    case 'h':
+        x *= 60;
+        // fallthrough
+    case 'm':
+        x *= 60;
+        // fallthrough
+    case 's':
+        end++;
+        // fallthrough
+    case 0:
+        break;
+    }
+    if (*end)
+        die("Invalid age: %s\n", arg);
+    return time(0) - x;
+}
+
+static void *add_entry(void *array, int *n, size_t size)
+{
+    array = realloc(array, (*n + 1) * size);
+    if (!array)
+        die("Out of memory.\n");
+    (*n)++;
+    return array;
+}
+
+static void add_exclude(const char *pat)
+{
+    filt.exclude = add_entry(filt.exclude, &filt.nexclude, sizeof(char *));
+    filt.exclude[filt.nexclude - 1] = pat;
+    filt.nslashed += !!strchr(pat, '/');
+}
+
+static void add_exclude_regex(const char *re)
+{
+    char err[256];
+    int ret;
+
+    filt.exclude_re = add_entry(filt.exclude_re, &filt.nexclude_re, sizeof(regex_t));
+    ret = regcomp(&filt.exclude_re[filt.nexclude_re - 1], re, REG_EXTENDED|REG_NOSUB);
+    if (ret)
+    {
+        regerror(ret, &filt.exclude_re[filt.nexclude_re - 1], err, sizeof(err));
+        die("%s: %s\n", re, err);
+    }
+}
+
+static void parse_options(int argc, char **argv)
+{
+    static const char *short_options = "bxhj:";
+    enum
+    {
+        OPT_INODE_ITEMS = 256,
+        OPT_EXCLUSIVE,
+        OPT_SHARE_MATRIX,
+        OPT_PER_ARG,
+        OPT_PIPELINE,
+        OPT_EMIT_SET,
+        OPT_MERGE,
+        OPT_READDIR_ORDER,
+        OPT_SCAN_STATS,
+        OPT_MAX_SEARCHES,
+        OPT_MAX_OPENS,
+        OPT_TARGET_LATENCY,
+        OPT_IDLE,
+        OPT_WATCH,
+        OPT_SHARE_HISTOGRAM,
+        OPT_BOOKEND,
+        OPT_ESTIMATE,
+        OPT_AGE,
+        OPT_LAYOUT,
+        OPT_PER_FILE,
+        OPT_PRINT0,
+        OPT_CHECKPOINT,
+        OPT_CHECKPOINT_INTERVAL,
+        OPT_RESUME,
+        OPT_KEEP_GOING,
+        OPT_FIEMAP,
+        OPT_BY_OWNER,
+        OPT_BY_EXT,
+        OPT_READ_AMP,
+        OPT_ESTIMATE_BW,
+        OPT_FRAG_REPORT,
+        OPT_FRAG_MIN,
+        OPT_FRAG_SORT,
+        OPT_EXCLUDE,
+        OPT_EXCLUDE_REGEX,
+        OPT_NAME,
+        OPT_MIN_SIZE,
+        OPT_MAX_SIZE,
+        OPT_NEWER,
+        OPT_OLDER,
+    };
+    static struct option long_options[] =
+    {
+        {"bytes",                  0, 0, 'b'},
+        {"one-file-system",        0, 0, 'x'},
         {"help",                   0, 0, 'h'},
+        {"jobs",                   1, 0, 'j'},
+        {"inode-items",            0, 0, OPT_INODE_ITEMS},
+        {"exclusive",              0, 0, OPT_EXCLUSIVE},
+        {"share-matrix",           2, 0, OPT_SHARE_MATRIX},
+        {"per-arg",                0, 0, OPT_PER_ARG},
+        {"pipeline",               2, 0, OPT_PIPELINE},
+        {"emit-set",               1, 0, OPT_EMIT_SET},
+        {"merge",                  0, 0, OPT_MERGE},
+        {"readdir-order",          0, 0, OPT_READDIR_ORDER},
+        {"scan-stats",             0, 0, OPT_SCAN_STATS},
+        {"max-searches",           1, 0, OPT_MAX_SEARCHES},
+        {"max-opens",              1, 0, OPT_MAX_OPENS},
+        {"target-latency",         1, 0, OPT_TARGET_LATENCY},
+        {"idle",                   0, 0, OPT_IDLE},
+        {"watch",                  2, 0, OPT_WATCH},
+        {"share-histogram",        0, 0, OPT_SHARE_HISTOGRAM},
+        {"bookend",                2, 0, OPT_BOOKEND},
+        {"estimate",               2, 0, OPT_ESTIMATE},
+        {"age",                    2, 0, OPT_AGE},
+        {"layout",                 0, 0, OPT_LAYOUT},
+        {"per-file",               1, 0, OPT_PER_FILE},
+        {"print0",                 0, 0, OPT_PRINT0},
+        {"checkpoint",             1, 0, OPT_CHECKPOINT},
+        {"checkpoint-interval",    1, 0, OPT_CHECKPOINT_INTERVAL},
+        {"resume",                 0, 0, OPT_RESUME},
+        {"keep-going",             0, 0, OPT_KEEP_GOING},
+        {"fiemap",                 0, 0, OPT_FIEMAP},
+        {"by-owner",               2, 0, OPT_BY_OWNER},
+        {"by-extension",           2, 0, OPT_BY_EXT},
+        {"read-amp",               2, 0, OPT_READ_AMP},
+        {"estimate-bw",            1, 0, OPT_ESTIMATE_BW},
+        {"frag-report",            1, 0, OPT_FRAG_REPORT},
+        {"frag-min",               1, 0, OPT_FRAG_MIN},
+        {"frag-sort",              1, 0, OPT_FRAG_SORT},
+        {"exclude",                1, 0, OPT_EXCLUDE},
+        {"exclude-regex",          1, 0, OPT_EXCLUDE_REGEX},
+        {"name",                   1, 0, OPT_NAME},
+        {"min-size",               1, 0, OPT_MIN_SIZE},
+        {"max-size",               1, 0, OPT_MAX_SIZE},
+        {"newer",                  1, 0, OPT_NEWER},
+        {"older",                  1, 0, OPT_OLDER},
         {0},
     };
 
-    while (1)
+    while (1)
+    {
+        switch (getopt_long(argc, argv, short_options, long_options, 0))
+        {
+        case 'b':
+            opt_bytes = 1;
+            break;
+        case 'x':
+            opt_one_fs = 1;
+            break;
+        case 'j':
+            opt_jobs = atoi(optarg);
+            if (opt_jobs < 1)
+                die("Invalid number of jobs: %s\n", optarg);
+            break;
+        case OPT_EXCLUSIVE:
+            opt_exclusive = 1;
+            opt_extent_recs = 1;
+            break;
+        case OPT_SHARE_MATRIX:
+            if (!optarg || !strcmp(optarg, "args"))
+                opt_share_matrix = 'a';
+            else if (!strcmp(optarg, "subvol"))
+                opt_share_matrix = 's';
+            else
+                die("Unknown grouping: %s\n", optarg);
+            opt_extent_recs = 1;
+            break;
+        case OPT_PER_ARG:
+            opt_per_arg = 1;
+            opt_extent_recs = 1;
+            break;
+        case OPT_EMIT_SET:
+            opt_emit_set = optarg;
+            opt_extent_recs = 1;
+            break;
+        case OPT_MERGE:
+            opt_merge = 1;
+            break;
+        case OPT_READDIR_ORDER:
+            opt_readdir_order = 1;
+            break;
+        case OPT_SCAN_STATS:
+            opt_scan_stats = 1;
+            break;
+        case OPT_MAX_SEARCHES:
+            if (atoi(optarg) < 1)
+                die("Invalid rate: %s\n", optarg);
+            search_rate.interval = 1000000000 / atoi(optarg);
+            break;
+        case OPT_MAX_OPENS:
+            if (atoi(optarg) < 1)
+                die("Invalid rate: %s\n", optarg);
+            open_rate.interval = 1000000000 / atoi(optarg);
+            break;
+        case OPT_TARGET_LATENCY:
+            if (atoi(optarg) < 1)
+                die("Invalid latency: %s\n", optarg);
+            target_latency = atoi(optarg) * 1000000ULL;
+            break;
+        case OPT_IDLE:
+            opt_idle = 1;
+            break;
+        case OPT_SHARE_HISTOGRAM:
+            opt_share_histogram = 1;
+            opt_extent_recs = 1;
+            break;
+        case OPT_BOOKEND:
+            if (optarg && (opt_bookend_top = atoi(optarg)) < 0)
+                die("Invalid number of files: %s\n", optarg);
+            opt_bookend = 1;
+            opt_extent_recs = 1;
+            break;
+        case OPT_ESTIMATE:
+            if (!NEST)
+                die("--estimate: built without zlib, lzo or zstd.\n");
+            opt_estimate = optarg ? strtod(optarg, 0) : 1;
+            if (opt_estimate <= 0 || opt_estimate > 100)
+                die("Invalid sample rate: %s\n", optarg);
+            break;
+        case OPT_PER_FILE:
+            opt_per_file = optarg;
+            break;
+        case OPT_PRINT0:
+            opt_print0 = 1;
+            break;
+        case OPT_CHECKPOINT:
+            opt_checkpoint = optarg;
+            break;
+        case OPT_CHECKPOINT_INTERVAL:
+            opt_checkpoint_interval = atoi(optarg);
+            if (opt_checkpoint_interval <= 0)
+                die("--checkpoint-interval: need a number of seconds, not %s\n", optarg);
+            break;
+        case OPT_RESUME:
+            opt_resume = 1;
+            break;
+        case OPT_KEEP_GOING:
+            opt_keep_going = 1;
+            break;
+        case OPT_FIEMAP:
+            use_fiemap();
+            break;
+        case OPT_READ_AMP:
+            opt_read_amp = 10;
+            if (optarg && (opt_read_amp = atoi(optarg)) <= 0)
+                die("Invalid number of files: %s\n", optarg);
+            break;
+        case OPT_BY_EXT:
+            opt_by_ext = 20;
+            if (optarg && (opt_by_ext = atoi(optarg)) <= 0)
+                die("Invalid number of extensions: %s\n", optarg);
+            break;
+        case OPT_BY_OWNER:
+            if (!optarg || !strcmp(optarg, "uid"))
+                opt_owner = 'u';
+            else if (!strcmp(optarg, "gid"))
+                opt_owner = 'g';
+            else
+                die("--by-owner: uid or gid (btrfs has no project ids), not %s\n", optarg);
+            opt_inode_items = 1;
+            opt_extent_recs = 1;
+            break;
+        case OPT_LAYOUT:
+            opt_layout = 1;
+            opt_extent_recs = 1;
+            break;
+        case OPT_AGE:
+            if (!optarg || !strcmp(optarg, "gen"))
+                opt_age = 'g';
+            else if (!strcmp(optarg, "time"))
+                opt_age = 't', opt_inode_items = 1;
+            else
+                die("--age: gen or time, not %s\n", optarg);
+            opt_extent_recs = 1;
+            break;
+        case OPT_ESTIMATE_BW:
+            est_bw = parse_size(optarg);
+            break;
+        case OPT_WATCH:
+            opt_watch = optarg ? atoi(optarg) : 60;
+            if (opt_watch < 1)
+                die("Invalid interval: %s\n", optarg);
+            opt_extent_recs = 1;
+            break;
+        case OPT_PIPELINE:
+            opt_pipeline = optarg ? atoi(optarg) : 8;
+            if (opt_pipeline < 2)
+                die("--pipeline needs at least 2 buffers.\n");
+            break;
+        case OPT_INODE_ITEMS:
+            opt_inode_items = 1;
+            break;
+        case OPT_FRAG_REPORT:
+            opt_frag_report = 1;
+            opt_frag_file = optarg;
+            break;
+        case OPT_FRAG_MIN:
+            opt_frag_min = strtoull(optarg, 0, 0);
+            break;
+        case OPT_FRAG_SORT:
+            if (!strcmp(optarg, "density"))
+                opt_frag_sort = 'd';
+            else if (!strcmp(optarg, "frags"))
+                opt_frag_sort = 'f';
+            else if (!strcmp(optarg, "size"))
+                opt_frag_sort = 's';
+            else
+                die("Unknown sort key: %s\n", optarg);
+            break;
+        case OPT_EXCLUDE:
+            add_exclude(optarg);
+            break;
+        case OPT_EXCLUDE_REGEX:
+            add_exclude_regex(optarg);
+            break;
+        case OPT_NAME:
+            filt.name = add_entry(filt.name, &filt.nname, sizeof(char *));
+            filt.name[filt.nname - 1] = optarg;
+            break;
+        case OPT_MIN_SIZE:
+            filt.min_size = parse_size(optarg);
+            filt.need_stat = 1;
+            break;
+        case OPT_MAX_SIZE:
+            filt.max_size = parse_size(optarg);
+            filt.need_stat = 1;
+            break;
+        case OPT_NEWER:
+            filt.newer = parse_age(optarg);
+            filt.need_stat = 1;
+            break;
+        case OPT_OLDER:
+            filt.older = parse_age(optarg);
+            filt.need_stat = 1;
+            break;
+        case 'h':
+            print_help();
+            exit(0);
+            break; // unreachable
+        case -1:
+            return;
+        default:
+            exit(1);
+        }
+    }
+}
+
+static void sum_types(struct workspace *ws)
+{
+    int t;
+
+    ws->uncomp_all = ws->disk_all = ws->refd_all = 0;
+    for (t=0; t<MAX_ENTRIES; t++)
+    {
+            ws->uncomp_all += ws->uncomp[t];
+            ws->disk_all   += ws->disk[t];
+            ws->refd_all   += ws->refd[t];
+    }
+}
+
+// buf holds the name of yet-unknown types.
+static const char *type_name(int t, char buf[12])
+{
+    const char *ct = t==PREALLOC? "prealloc" : comp_types[t];
+
+    if (ct)
+        return ct;
+    snprintf(buf, 12, "?%u", t);
+    return buf;
+}
+
+static void print_type_table(struct workspace *ws)
+{
+    char perc[8], disk_usage[HB], uncomp_usage[HB], refd_usage[HB];
+    uint32_t percentage;
+    int t;
+
+    print_table("Type", "Perc", "Disk Usage", "Uncompressed", "Referenced");
+    percentage = ws->uncomp_all ? ws->disk_all*100/ws->uncomp_all : 0;
+    snprintf(perc, sizeof(perc), "%3u%%", percentage);
+    human_bytes(ws->disk_all, disk_usage);
+    human_bytes(ws->uncomp_all, uncomp_usage);
+    human_bytes(ws->refd_all, refd_usage);
+    print_table("TOTAL", perc, disk_usage, uncomp_usage, refd_usage);
+
+    for (t=0; t<MAX_ENTRIES; t++)
+    {
+        if (!ws->uncomp[t])
+            continue;
+        char unkn_comp[12];
+        percentage = ws->disk[t]*100/ws->uncomp[t];
+        snprintf(perc, sizeof(perc), "%3u%%", percentage);
+        human_bytes(ws->disk[t], disk_usage);
+        human_bytes(ws->uncomp[t], uncomp_usage);
+        human_bytes(ws->refd[t], refd_usage);
+        print_table(type_name(t, unkn_comp), perc, disk_usage, uncomp_usage, refd_usage);
+    }
+}
+
+static int print_stats(struct workspace *ws)
+{
+    sum_types(ws);
+
+    if (!ws->uncomp_all)
+    {
+        if (!ws->nfiles)
+            fprintf(stderr, "No files.\n");
+        else
+            fprintf(stderr, "All empty or still-delalloced files.\n");
+        return 1;
+    }
+
+    printf("Processed %"PRIu64" file%s, %"PRIu64" regular extents "
+           "(%"PRIu64" refs), %"PRIu64" inline, %"PRIu64" fragments.\n",
+           ws->nfiles, ws->nfiles>1 ? "s" : "",
+           ws->nextents, ws->nrefs, ws->ninline, ws->nfrag);
+    if (opt_fiemap)
+        printf("From FIEMAP: compression types, compressed sizes and sharing are "
+               "approximate.\n");
+
+    print_type_table(ws);
+
+    return 0;
+}
+
+// Fills a freshly allocated array with every extent_rec in the seen set,
+// in bytenr order.
+static size_t collect_extents(struct workspace *ws, struct extent_rec ***recs)
+{
+    struct extent_rec *batch[256];
+    unsigned long index = 0;
+    size_t n = 0, alloc = 0;
+    unsigned int i, got;
+
+    *recs = 0;
+    while ((got = radix_tree_gang_lookup(&ws->seen_extents, (void **)batch,
+                                         index, ARRAY_SIZE(batch))))
+    {
+        if (n + got > alloc)
+        {
+            alloc = alloc ? alloc * 2 : 65536;
+            *recs = realloc(*recs, alloc * sizeof(**recs));
+            if (!*recs)
+                die("Out of memory.\n");
+        }
+        for (i = 0; i < got; i++)
+            (*recs)[n++] = batch[i];
+        index = (batch[got - 1]->bytenr >> 12) + 1;
+    }
+    return n;
+}
+
+struct resolve_job
+{
+    struct extent_rec **recs;
+    size_t nrecs;
+    size_t next;
+};
+
+// Does anything outside the scanned set reference this extent?
+static int has_outside_refs(const struct extent_rec *rec,
+                            struct btrfs_data_container **inodes, uint32_t *size)
+{
+    struct btrfs_ioctl_logical_ino_args args;
+    struct radix_tree_root *ri;
+    uint32_t i;
+
+again:
+    memset(&args, 0, sizeof(args));
+    args.logical = rec->bytenr;
+    args.size = *size;
+    args.flags = BTRFS_LOGICAL_INO_ARGS_IGNORE_OFFSET;
+    args.inodes = ptr_to_u64(*inodes);
+    if (ioctl(fs_fd, BTRFS_IOC_LOGICAL_INO_V2, &args))
+    {
+        if (errno == ENOENT) // freed since
+            return 0;
+        if (errno == ENOTTY)
+            die("LOGICAL_INO_V2 unsupported, --exclusive needs kernel 4.15+.\n");
+        die("LOGICAL_INO_V2 at %"PRIu64": %m\n", rec->bytenr);
+    }
+
+    if ((*inodes)->elem_missed)
+    {
+        // Too many refs to list, and certainly not all ours.
+        if (*size >= SZ_16M)
+            return 1;
+        *size = SZ_16M;
+        *inodes = realloc(*inodes, *size);
+        if (!*inodes)
+            die("Out of memory.\n");
+        goto again;
+    }
+
+    // (inode, offset, root) triplets
+    for (i = 0; i + 2 < (*inodes)->elem_cnt; i += 3)
+    {
+        ri = find_root_inodes((*inodes)->val[i + 2]);
+        if (!ri || !radix_tree_lookup(ri, (*inodes)->val[i]))
+            return 1;
+    }
+    return 0;
+}
+
+static void *resolve_worker(void *arg)
+{
+    struct resolve_job *job = arg;
+    struct btrfs_data_container *inodes;
+    struct extent_rec *rec;
+    uint32_t size = 65536;
+    size_t i;
+
+    inodes = malloc(size);
+    if (!inodes)
+        die("Out of memory.\n");
+
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->nrecs)
+    {
+        rec = job->recs[i];
+        if (rec->flags & EXT_RESOLVED)
+            continue;
+        if (has_outside_refs(rec, &inodes, &size))
+            rec->flags |= EXT_SHARED;
+        rec->flags |= EXT_RESOLVED;
+    }
+
+    free(inodes);
+    return 0;
+}
+
+// Backref lookups are slow (each walks the extent tree and every
+// referencing tree), but independent; spread them over opt_jobs threads.
+static void resolve_backrefs(struct extent_rec **recs, size_t n)
+{
+    struct resolve_job job = { recs, n, 0 };
+    pthread_t *threads;
+    int i;
+
+    threads = calloc(opt_jobs, sizeof(*threads));
+    if (!threads)
+        die("Out of memory.\n");
+    for (i = 0; i < opt_jobs; i++)
+        if (pthread_create(&threads[i], 0, resolve_worker, &job))
+            die("pthread_create: %m\n");
+    for (i = 0; i < opt_jobs; i++)
+        pthread_join(threads[i], 0);
+    free(threads);
+}
+
+static void print_exclusive(struct workspace *ws)
+{
+    struct extent_rec **recs;
+    struct workspace *ex;
+    size_t i, n;
+
+    n = collect_extents(ws, &recs);
+    if (fs_fd != -1)
+        resolve_backrefs(recs, n);
+
+    ex = calloc(sizeof(*ex), 1);
+    if (!ex)
+        die("Out of memory.\n");
+    for (i = 0; i < n; i++)
+    {
+        if (recs[i]->flags & EXT_SHARED)
+            continue;
+        ex->disk[recs[i]->comp_type] += recs[i]->disk;
+        ex->uncomp[recs[i]->comp_type] += recs[i]->uncomp;
+        ex->refd[recs[i]->comp_type] += recs[i]->refd;
+    }
+    free(recs);
+
+    sum_types(ex);
+    printf("Exclusive (regular extents not referenced from outside):\n");
+    print_type_table(ex);
+    free(ex);
+}
+
+// Disk bytes referenced from both group i and j (diagonal: from i at all),
+// then what's referenced only from a single group.
+static void print_share_matrix(struct workspace *ws)
+{
+    struct extent_rec **recs;
+    uint64_t (*shared)[MAX_GROUPS], *unique;
+    char buf[HB];
+    size_t k, n;
+    int i, j;
+
+    shared = calloc(MAX_GROUPS, sizeof(*shared));
+    unique = calloc(MAX_GROUPS, sizeof(*unique));
+    if (!shared || !unique)
+        die("Out of memory.\n");
+
+    n = collect_extents(ws, &recs);
+    for (k = 0; k < n; k++)
+    {
+        uint64_t m = recs[k]->groups;
+        if (!(m & (m - 1)))
+            unique[__builtin_ctzll(m)] += recs[k]->disk;
+        for (i = 0; i < ngroups; i++)
+        {
+            if (!(m & 1ULL << i))
+                continue;
+            for (j = 0; j < ngroups; j++)
+                if (m & 1ULL << j)
+                    shared[i][j] += recs[k]->disk;
+        }
+    }
+    free(recs);
+
+    printf("\nShared disk usage:\n%-6s", "");
+    for (j = 0; j < ngroups; j++)
+        printf(" %-12d", j + 1);
+    printf(" %-12s\n", "Unique");
+    for (i = 0; i < ngroups; i++)
+    {
+        printf("%-6d", i + 1);
+        for (j = 0; j < ngroups; j++)
+        {
+            human_bytes(shared[i][j], buf);
+            printf(" %-12s", buf);
+        }
+        human_bytes(unique[i], buf);
+        printf(" %-12s\n", buf);
+    }
+    for (i = 0; i < ngroups; i++)
+        printf("%d: %s\n", i + 1, groups[i].label);
+
+    free(shared);
+    free(unique);
+}
+
+// Extent set files (--emit-set, --merge): a header with the counters that
+// simply add up across disjoint scans, then every regular extent in
+// bytenr order, so that sets can be unioned in a single streaming pass.
+// All numbers are LEB128 varints:
+//   magic, flags, nfiles, nrefs, ninline, nfrag,
+//   ntypes, { type, inline disk, inline uncomp, referenced } * ntypes,
+//   { bytenr - previous bytenr, disk, uncomp, type } * nextents, 0
+static const char set_magic[8] = "cpsset2\n";
+#define SET_FIEMAP      1 // scanned with FIEMAP: sizes and types approximate
+
+struct set_reader
+{
+        FILE *f;
+        const char *path;
+        uint64_t bytenr, disk, uncomp, type;
+};
+
+static void put_varint(FILE *f, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        putc((v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    putc(v, f);
+}
+
+static uint64_t get_varint(struct set_reader *r)
+{
+    uint64_t v = 0;
+    int c, shift = 0;
+
+    do
+    {
+        if ((c = getc(r->f)) == EOF || shift > 63)
+            die("%s: truncated or corrupt extent set.\n", r->path);
+        v |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return v;
+}
+
+static void write_set_header(FILE *f, struct workspace *ws,
+                             const uint64_t *ext_disk, const uint64_t *ext_uncomp)
+{
+    int t, ntypes = 0;
+
+    fwrite(set_magic, sizeof(set_magic), 1, f);
+    put_varint(f, opt_fiemap ? SET_FIEMAP : 0);
+    put_varint(f, ws->nfiles);
+    put_varint(f, ws->nrefs);
+    put_varint(f, ws->ninline);
+    put_varint(f, ws->nfrag);
+    for (t = 0; t < MAX_ENTRIES; t++)
+        if (ws->uncomp[t] || ws->refd[t])
+            ntypes++;
+    put_varint(f, ntypes);
+    for (t = 0; t < MAX_ENTRIES; t++)
+    {
+        if (!ws->uncomp[t] && !ws->refd[t])
+            continue;
+        put_varint(f, t);
+        put_varint(f, ws->disk[t] - ext_disk[t]);
+        put_varint(f, ws->uncomp[t] - ext_uncomp[t]);
+        put_varint(f, ws->refd[t]);
+    }
+}
+
+static void put_set_extent(FILE *f, uint64_t *prev, uint64_t bytenr,
+                           uint64_t disk, uint64_t uncomp, unsigned type)
+{
+    put_varint(f, bytenr - *prev);
+    put_varint(f, disk);
+    put_varint(f, uncomp);
+    put_varint(f, type);
+    *prev = bytenr;
+}
+
+static void close_set(FILE *f, const char *path)
+{
+    put_varint(f, 0);
+    if (fclose(f))
+        die("%s: %m\n", path);
+}
+
+static void emit_set(struct workspace *ws, const char *path)
+{
+    uint64_t ext_disk[MAX_ENTRIES] = {0}, ext_uncomp[MAX_ENTRIES] = {0};
+    struct extent_rec **recs;
+    uint64_t prev = 0;
+    size_t i, n;
+    FILE *f;
+
+    if (!(f = fopen(path, "w")))
+        die("%s: %m\n", path);
+
+    n = collect_extents(ws, &recs);
+    for (i = 0; i < n; i++)
+    {
+        ext_disk[recs[i]->comp_type] += recs[i]->disk;
+        ext_uncomp[recs[i]->comp_type] += recs[i]->uncomp;
+    }
+    write_set_header(f, ws, ext_disk, ext_uncomp);
+    for (i = 0; i < n; i++)
+        put_set_extent(f, &prev, recs[i]->bytenr, recs[i]->disk,
+                       recs[i]->uncomp, recs[i]->comp_type);
+    free(recs);
+    close_set(f, path);
+}
+
+// Reads the next extent; returns 0 at the end of the set.
+static int next_set_extent(struct set_reader *r)
+{
+    uint64_t delta = get_varint(r);
+
+    if (!delta)
+        return 0;
+    r->bytenr += delta;
+    r->disk = get_varint(r);
+    r->uncomp = get_varint(r);
+    r->type = get_varint(r);
+    if (r->type >= MAX_ENTRIES)
+        die("%s: corrupt extent set.\n", r->path);
+    return 1;
+}
+
+static void open_set(struct set_reader *r, const char *path, struct workspace *ws)
+{
+    char magic[sizeof(set_magic)];
+    uint64_t ntypes, t;
+
+    r->path = path;
+    r->bytenr = 0;
+    if (!(r->f = fopen(path, "r")))
+        die("%s: %m\n", path);
+    if (fread(magic, sizeof(magic), 1, r->f) != 1
+        || memcmp(magic, set_magic, sizeof(magic)))
+        die("%s: not an extent set.\n", path);
+
+    // The union of sets is as approximate as the worst of them.
+    if (get_varint(r) & SET_FIEMAP)
+        use_fiemap();
+    ws->nfiles += get_varint(r);
+    ws->nrefs += get_varint(r);
+    ws->ninline += get_varint(r);
+    ws->nfrag += get_varint(r);
+    ntypes = get_varint(r);
+    while (ntypes--)
+    {
+        if ((t = get_varint(r)) >= MAX_ENTRIES)
+            die("%s: corrupt extent set.\n", path);
+        ws->disk[t] += get_varint(r);
+        ws->uncomp[t] += get_varint(r);
+        ws->refd[t] += get_varint(r);
+    }
+}
+
+// Checkpoints (--checkpoint, --resume): the arguments, which of them is
+// being scanned, the directories still pending for it, the counters, errors
+// so far and every extent seen.  Varints as in extent sets, strings as a
+// length and the bytes:
+//   magic, nargs, { arg } * nargs, arg index,
+//   nfiles, nextents, nrefs, ninline, nfrag,
+//   ntypes, { type, disk, uncomp, referenced } * ntypes,
+//   npending, { path, dev, top } * npending, nerrors, { error } * nerrors,
+//   nkeys, { page - previous page } * nkeys
+static const char ckpt_magic[8] = "cpsckp1\n";
+
+static char **ckpt_args;
+static int ckpt_nargs, ckpt_arg; // argument being scanned
+static time_t ckpt_last;
+
+static void put_string(FILE *f, const char *s)
+{
+    size_t len = strlen(s);
+
+    put_varint(f, len);
+    fwrite(s, len, 1, f);
+}
+
+static char *get_string(struct set_reader *r)
+{
+    uint64_t len = get_varint(r);
+    char *s;
+
+    if (len > PATH_MAX + 256 || !(s = malloc(len + 1)))
+        die("%s: corrupt checkpoint.\n", r->path);
+    if (len && fread(s, len, 1, r->f) != 1)
+        die("%s: truncated checkpoint.\n", r->path);
+    s[len] = 0;
+    return s;
+}
+
+static void write_checkpoint(struct workspace *ws)
+{
+    char tmp[PATH_MAX];
+    void *batch[256];
+    unsigned long index = 0, prev = 0;
+    uint64_t nkeys = 0;
+    unsigned int i, got;
+    int t, ntypes = 0;
+    size_t k;
+    FILE *f;
+
+    drain_pipeline();
+    snprintf(tmp, sizeof(tmp), "%s.tmp", opt_checkpoint);
+    if (!(f = fopen(tmp, "w")))
+        die("%s: %m\n", tmp);
+
+    fwrite(ckpt_magic, sizeof(ckpt_magic), 1, f);
+    put_varint(f, ckpt_nargs);
+    for (t = 0; t < ckpt_nargs; t++)
+        put_string(f, ckpt_args[t]);
+    put_varint(f, ckpt_arg);
+
+    put_varint(f, ws->nfiles);
+    put_varint(f, ws->nextents);
+    put_varint(f, ws->nrefs);
+    put_varint(f, ws->ninline);
+    put_varint(f, ws->nfrag);
+    for (t = 0; t < MAX_ENTRIES; t++)
+        if (ws->uncomp[t] || ws->refd[t])
+            ntypes++;
+    put_varint(f, ntypes);
+    for (t = 0; t < MAX_ENTRIES; t++)
+    {
+        if (!ws->uncomp[t] && !ws->refd[t])
+            continue;
+        put_varint(f, t);
+        put_varint(f, ws->disk[t]);
+        put_varint(f, ws->uncomp[t]);
+        put_varint(f, ws->refd[t]);
+    }
+
+    put_varint(f, npending);
+    for (k = 0; k < npending; k++)
+    {
+        put_string(f, pending[k].path);
+        put_varint(f, pending[k].dev);
+        put_varint(f, pending[k].top);
+    }
+    pthread_mutex_lock(&errors_lock);
+    put_varint(f, nerrors);
+    for (k = 0; k < nerrors; k++)
+        put_string(f, errors[k]);
+    pthread_mutex_unlock(&errors_lock);
+
+    // The set's values are the keys themselves (page numbers).
+    while ((got = radix_tree_gang_lookup(&ws->seen_extents, batch, index,
+                                         ARRAY_SIZE(batch))))
+    {
+        nkeys += got;
+        index = (unsigned long)batch[got - 1] + 1;
+    }
+    put_varint(f, nkeys);
+    index = 0;
+    while ((got = radix_tree_gang_lookup(&ws->seen_extents, batch, index,
+                                         ARRAY_SIZE(batch))))
+    {
+        for (i = 0; i < got; i++)
+        {
+            put_varint(f, (unsigned long)batch[i] - prev);
+            prev = (unsigned long)batch[i];
+        }
+        index = prev + 1;
+    }
+
+    if (fflush(f) || ferror(f) || fsync(fileno(f)) || fclose(f))
+        die("%s: %m\n", tmp);
+    if (rename(tmp, opt_checkpoint))
+        die("rename(\"%s\"): %m\n", opt_checkpoint);
+    ckpt_last = time(0);
+}
+
+// Called between directories: every --checkpoint-interval seconds, and
+// on SIGTERM/SIGINT, which then stop the scan.
+static void maybe_checkpoint(struct workspace *ws)
+{
+    if (sig_checkpoint)
+    {
+        write_checkpoint(ws);
+        fprintf(stderr, "Interrupted; continue with --resume --checkpoint=%s\n",
+                opt_checkpoint);
+        exit(1);
+    }
+    if (time(0) - ckpt_last >= opt_checkpoint_interval)
+        write_checkpoint(ws);
+}
+
+// Restores the state saved in the checkpoint, which must be of a scan of
+// the same arguments.  Returns the index of the argument to continue in,
+// with its pending directories on the stack, or -1 if there's none yet.
+static int load_checkpoint(struct workspace *ws)
+{
+    struct set_reader r = { 0 };
+    char magic[sizeof(ckpt_magic)], *s;
+    uint64_t n, t, page = 0;
+    int arg;
+
+    r.path = opt_checkpoint;
+    if (!(r.f = fopen(opt_checkpoint, "r")))
+    {
+        if (errno == ENOENT)
+            return -1;
+        die("%s: %m\n", opt_checkpoint);
+    }
+    if (fread(magic, sizeof(magic), 1, r.f) != 1
+        || memcmp(magic, ckpt_magic, sizeof(magic)))
+        die("%s: not a checkpoint.\n", opt_checkpoint);
+
+    if (get_varint(&r) != ckpt_nargs)
+        die("%s: checkpoint of a scan of other paths.\n", opt_checkpoint);
+    for (arg = 0; arg < ckpt_nargs; arg++)
+    {
+        s = get_string(&r);
+        if (strcmp(s, ckpt_args[arg]))
+            die("%s: checkpoint of a scan of other paths.\n", opt_checkpoint);
+        free(s);
+    }
+    if ((arg = get_varint(&r)) >= ckpt_nargs)
+        die("%s: corrupt checkpoint.\n", opt_checkpoint);
+
+    ws->nfiles = get_varint(&r);
+    ws->nextents = get_varint(&r);
+    ws->nrefs = get_varint(&r);
+    ws->ninline = get_varint(&r);
+    ws->nfrag = get_varint(&r);
+    n = get_varint(&r);
+    while (n--)
+    {
+        if ((t = get_varint(&r)) >= MAX_ENTRIES)
+            die("%s: corrupt checkpoint.\n", opt_checkpoint);
+        ws->disk[t] = get_varint(&r);
+        ws->uncomp[t] = get_varint(&r);
+        ws->refd[t] = get_varint(&r);
+    }
+
+    n = get_varint(&r);
+    while (n--)
+    {
+        s = get_string(&r);
+        t = get_varint(&r);
+        push_dir(s, t, get_varint(&r));
+    }
+    n = get_varint(&r);
+    while (n--)
+    {
+        s = get_string(&r);
+        add_error(s);
+        free(s);
+    }
+
+    n = get_varint(&r);
+    while (n--)
+    {
+        page += get_varint(&r);
+        radix_tree_preload(GFP_KERNEL);
+        radix_tree_insert(&ws->seen_extents, page, (void *)(unsigned long)page);
+        radix_tree_preload_end();
+    }
+    fclose(r.f);
+    return arg;
+}
+
+static void sift_down(struct set_reader **heap, int n, int i)
+{
+    struct set_reader *r = heap[i];
+    int c;
+
+    while ((c = 2 * i + 1) < n)
+    {
+        if (c + 1 < n && heap[c + 1]->bytenr < heap[c]->bytenr)
+            c++;
+        if (heap[c]->bytenr >= r->bytenr)
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = r;
+}
+
+// Unions the sets with a k-way merge on bytenr, counting each extent once.
+// Only one extent per set is in memory at a time.
+static void merge_sets(char **paths, int nsets, struct workspace *ws)
+{
+    struct set_reader *readers, **heap, *r;
+    uint64_t last = 0, prev = 0;
+    FILE *out = 0;
+    int i, n = 0;
+
+    readers = calloc(nsets, sizeof(*readers));
+    heap = calloc(nsets, sizeof(*heap));
+    if (!readers || !heap)
+        die("Out of memory.\n");
+
+    for (i = 0; i < nsets; i++)
+    {
+        open_set(&readers[i], paths[i], ws);
+        if (next_set_extent(&readers[i]))
+            heap[n++] = &readers[i];
+    }
+    for (i = n / 2 - 1; i >= 0; i--)
+        sift_down(heap, n, i);
+
+    // Everything in the header is known by now; the extents stream through.
+    if (opt_emit_set)
+    {
+        uint64_t none[MAX_ENTRIES] = {0};
+
+        if (!(out = fopen(opt_emit_set, "w")))
+            die("%s: %m\n", opt_emit_set);
+        write_set_header(out, ws, none, none);
+    }
+
+    while (n)
+    {
+        r = heap[0];
+        if (r->bytenr != last)
+        {
+            last = r->bytenr;
+            add_extent(ws, r->type, r->disk, r->uncomp);
+            if (out)
+                put_set_extent(out, &prev, r->bytenr, r->disk, r->uncomp, r->type);
+        }
+        if (!next_set_extent(r))
+        {
+            fclose(r->f);
+            heap[0] = heap[--n];
+        }
+        if (n)
+            sift_down(heap, n, 0);
+    }
+
+    if (out)
+        close_set(out, opt_emit_set);
+    free(heap);
+    free(readers);
+}
+
+// Bytes this process caused to be read from storage, if the kernel says.
+static int io_read_bytes(uint64_t *bytes)
+{
+    char line[128];
+    FILE *f;
+    int ret = -1;
+
+    if (!(f = fopen("/proc/self/io", "r")))
+        return -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "read_bytes: %"SCNu64, bytes) == 1)
+        {
+            ret = 0;
+            break;
+        }
+    fclose(f);
+    return ret;
+}
+
+static void print_scan_stats(uint64_t read_before)
+{
+    char buf[HB];
+    uint64_t read_after;
+
+    fprintf(stderr, "Scanned %"PRIu64" directories, %"PRIu64" files "
+            "with %"PRIu64" tree searches",
+            scan_stats.dirs, scan_stats.files, scan_stats.searches);
+    if (scan_stats.items)
+        fprintf(stderr, " (%"PRIu64" items, %"PRIu64" of other inodes)",
+                scan_stats.items, scan_stats.foreign);
+    if (read_before != (uint64_t)-1 && !io_read_bytes(&read_after))
+    {
+        human_bytes(read_after - read_before, buf);
+        fprintf(stderr, "; %s read from disk", buf + strspn(buf, " "));
+    }
+    fprintf(stderr, ".\n");
+}
+
+// Extents, and their disk usage, by how many file extent items point to
+// them: 1, 2, 3-4, 5-8, ...  Shows whether dedup is paying off.
+#define SHARE_BUCKETS 33
+
+static void print_share_histogram(struct workspace *ws)
+{
+    struct bucket
+    {
+            uint64_t n, disk, refd;
+    } (*hist)[MAX_ENTRIES], *h;
+    struct extent_rec **recs;
+    char label[32], count[24], disk[HB], refd[HB], unkn_comp[12];
+    size_t i, n;
+    int b, t;
+
+    hist = calloc(SHARE_BUCKETS, sizeof(*hist));
+    if (!hist)
+        die("Out of memory.\n");
+
+    n = collect_extents(ws, &recs);
+    for (i = 0; i < n; i++)
+    {
+        uint32_t refs = recs[i]->refs;
+        b = refs <= 1 ? 0 : 32 - __builtin_clz(refs - 1);
+        h = &hist[b][recs[i]->comp_type];
+        h->n++;
+        h->disk += recs[i]->disk;
+        h->refd += recs[i]->refd;
+    }
+    free(recs);
+
+    printf("\nExtents by number of references:\n");
+    print_table("Refs", "Type", "Extents", "Disk Usage", "Referenced");
+    for (b = 0; b < SHARE_BUCKETS; b++)
+        for (t = 0; t < MAX_ENTRIES; t++)
+        {
+            h = &hist[b][t];
+            if (!h->n)
+                continue;
+            if (b < 2)
+                snprintf(label, sizeof(label), "%d", b + 1);
+            else
+                snprintf(label, sizeof(label), "%"PRIu64"-%"PRIu64,
+                         ((uint64_t)1 << (b - 1)) + 1, (uint64_t)1 << b);
+            snprintf(count, sizeof(count), "%"PRIu64, h->n);
+            human_bytes(h->disk, disk);
+            human_bytes(h->refd, refd);
+            print_table(label, type_name(t, unkn_comp), count, disk, refd);
+        }
+
+    free(hist);
+}
+
+struct bookend_file
+{
+        uint64_t bytes;
+        const char *path;
+};
+
+static int cmp_bookend_file(const void *a, const void *b)
+{
+    uint64_t x = ((const struct bookend_file *)a)->bytes;
+    uint64_t y = ((const struct bookend_file *)b)->bytes;
+
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Uncompressed bytes of extents that no scanned file references, yet stay
+// allocated as the rest of the extent is; disk usage prorated for them.
+static void print_bookend(struct workspace *ws)
+{
+    uint64_t n[MAX_ENTRIES] = {0}, unref[MAX_ENTRIES] = {0}, pinned[MAX_ENTRIES] = {0};
+    char perc[8], count[24], disk[HB], bytes[HB], unkn_comp[12];
+    struct bookend_file *files;
+    struct extent_rec **recs;
+    struct bookend *be;
+    uint64_t u, total = 0;
+    size_t i, k, nrecs;
+    uint32_t j;
+    int t;
+
+    files = calloc(nfile_names, sizeof(*files));
+    if (nfile_names && !files)
+        die("Out of memory.\n");
+    for (j = 0; j < nfile_names; j++)
+        files[j].path = file_names[j];
+
+    nrecs = collect_extents(ws, &recs);
+    for (i = 0; i < nrecs; i++)
+    {
+        if (!(be = recs[i]->bookend))
+            continue;
+        u = recs[i]->uncomp;
+        for (j = 0; j < be->n; j++)
+            u -= (be->r[j].end < recs[i]->uncomp ? be->r[j].end
+                                                 : recs[i]->uncomp) - be->r[j].start;
+        if (!u)
+            continue;
+        t = recs[i]->comp_type;
+        n[t]++;
+        unref[t] += u;
+        pinned[t] += recs[i]->uncomp ? recs[i]->disk * u / recs[i]->uncomp : 0;
+        files[be->owner - 1].bytes += u;
+        total++;
+    }
+    free(recs);
+
+    if (!total)
+    {
+        printf("\nNo partly referenced extents.\n");
+        free(files);
+        return;
+    }
+
+    printf("\nPartly referenced extents:\n");
+    print_table("Type", "Perc", "Extents", "Disk Pinned", "Unreferenced");
+    for (t = 0; t < MAX_ENTRIES; t++)
+    {
+        if (!n[t])
+            continue;
+        snprintf(perc, sizeof(perc), "%3u%%",
+                 ws->uncomp[t] ? (uint32_t)(unref[t] * 100 / ws->uncomp[t]) : 0);
+        snprintf(count, sizeof(count), "%"PRIu64, n[t]);
+        human_bytes(pinned[t], disk);
+        human_bytes(unref[t], bytes);
+        print_table(type_name(t, unkn_comp), perc, count, disk, bytes);
+    }
+
+    if (nfile_names)
+        qsort(files, nfile_names, sizeof(*files), cmp_bookend_file);
+    printf("\nFiles pinning the most unreferenced data:\n");
+    for (k = 0; k < nfile_names && k < (size_t)opt_bookend_top; k++)
+    {
+        if (!files[k].bytes)
+            break;
+        human_bytes(files[k].bytes, bytes);
+        printf("%s\t%s\n", bytes, files[k].path);
+    }
+    free(files);
+}
+
+// Reading the samples back is throttled to est_bw in total.
+static void est_bw_wait(uint64_t len)
+{
+    uint64_t now, start;
+
+    if (!est_bw)
+        return;
+    pthread_mutex_lock(&est_bw_lock);
+    now = now_ns();
+    start = est_bw_next > now ? est_bw_next : now;
+    est_bw_next = start + len * 1000000000 / est_bw;
+    pthread_mutex_unlock(&est_bw_lock);
+    if (start > now)
+        sleep_ns(start - now);
+}
+
+struct est_job
+{
+        pthread_mutex_t lock;
+        size_t next;
+        uint64_t read;
+};
+
+// Hands out the samples a whole file at a time (they were added in scan
+// order, so a file's are contiguous), so that each open serves all of them.
+static size_t est_claim(struct est_job *job, size_t *end)
+{
+    size_t i;
+
+    pthread_mutex_lock(&job->lock);
+    i = *end = job->next;
+    while (*end < nsamples && samples[*end].file == samples[i].file)
+        ++*end;
+    job->next = *end;
+    pthread_mutex_unlock(&job->lock);
+    return i;
+}
+
+static void *est_worker(void *arg)
+{
+    struct est_job *job = arg;
+    struct est_sample *s;
+    uint8_t *in, *out;
+    void *work;
+    uint32_t file = 0;
+    size_t i, end, j, n, cap = 2 * EST_BLOCK;
+    ssize_t got;
+    int fd = -1;
+
+    in = malloc(EST_BLOCK);
+    out = malloc(cap);
+#ifdef HAVE_LZO
+    work = malloc(LZO1X_1_MEM_COMPRESS);
+#else
+    work = malloc(1);
+#endif
+    if (!in || !out || !work)
+        die("Out of memory.\n");
+
+    i = end = 0;
+    for (;;)
+    {
+        if (i == end && (i = est_claim(job, &end)) == end)
+            break;
+        s = &samples[i++];
+        if (s->file != file)
+        {
+            if (fd != -1)
+                close(fd);
+            file = s->file;
+            fd = open(file_names[file - 1], O_RDONLY|O_NOFOLLOW|O_NOCTTY);
+        }
+        if (fd == -1)
+            continue;
+        est_bw_wait(s->len);
+        got = pread(fd, in, s->len, s->offset);
+        if (got <= 0)
+            continue;
+        __sync_fetch_and_add(&job->read, got);
+        s->len = got;
+        for (j = 0; j < NEST; j++)
+        {
+            n = estimators[j].compress(in, got, out, cap, work);
+            n = (n + 4095) & ~4095ULL;
+            s->out[j] = n < (size_t)got ? n : got;
+        }
+    }
+
+    if (fd != -1)
+        close(fd);
+    free(in);
+    free(out);
+    free(work);
+    return 0;
+}
+
+static uint64_t est_saved(const struct est_group *g, int j)
+{
+    return g->disk - (uint64_t)((long double)g->disk * g->out[j] / g->in);
+}
+
+// Most saved by the last (usually best) compressor first.
+static int cmp_est_group(const void *a, const void *b)
+{
+    uint64_t x = est_saved(((const struct name_slot *)a)->value, NEST - 1);
+    uint64_t y = est_saved(((const struct name_slot *)b)->value, NEST - 1);
+
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Uncompressed disk usage, then what each compressor would save, for the
+// EST_TOP directories or extensions where that's the most.
+#define EST_TOP 10
+
+static void print_est_groups(const char *title, struct name_map *m)
+{
+    struct name_slot *slots = calloc(m->n + 1, sizeof(*slots));
+    struct est_group *g;
+    char buf[HB];
+    size_t i, j, n = 0;
+
+    if (!slots)
+        die("Out of memory.\n");
+    for (i = 0; i < m->size; i++)
+    {
+        g = m->slots[i].value;
+        if (m->slots[i].name && g->in)
+            slots[n++] = m->slots[i];
+    }
+    qsort(slots, n, sizeof(*slots), cmp_est_group);
+
+    printf("\nUncomp.");
+    for (j = 0; j < NEST; j++)
+        printf("\t%s", estimators[j].name);
+    printf("\t%s\n", title);
+    for (i = 0; i < n && i < EST_TOP; i++)
+    {
+        g = slots[i].value;
+        human_bytes(g->disk, buf);
+        printf("%s", buf + strspn(buf, " "));
+        for (j = 0; j < NEST; j++)
+        {
+            human_bytes(est_saved(g, j), buf);
+            printf("\t%s", buf + strspn(buf, " "));
+        }
+        printf("\t%s\n", *slots[i].name ? slots[i].name : "(none)");
+    }
+    free(slots);
+}
+
+static void print_estimate(void)
+{
+    struct est_job job = { PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+    uint64_t in = 0, out[EST_MAX] = {0};
+    char perc[8], disk[HB], proj[HB], saved[HB];
+    pthread_t *threads;
+    size_t i, j;
+    int t;
+
+#ifdef HAVE_LZO
+    if (lzo_init() != LZO_E_OK)
+        die("lzo_init failed.\n");
+#endif
+    threads = calloc(opt_jobs, sizeof(*threads));
+    if (!threads)
+        die("Out of memory.\n");
+    for (t = 0; t < opt_jobs; t++)
+        if (pthread_create(&threads[t], 0, est_worker, &job))
+            die("pthread_create: %m\n");
+    for (t = 0; t < opt_jobs; t++)
+        pthread_join(threads[t], 0);
+    free(threads);
+
+    for (i = 0; i < nsamples; i++)
+    {
+        if (!samples[i].out[0])
+            continue; // unreadable
+        in += samples[i].len;
+        samples[i].dir->in += samples[i].len;
+        samples[i].ext->in += samples[i].len;
+        for (j = 0; j < NEST; j++)
+        {
+            out[j] += samples[i].out[j];
+            samples[i].dir->out[j] += samples[i].out[j];
+            samples[i].ext->out[j] += samples[i].out[j];
+        }
+    }
+
+    human_bytes(job.read, disk);
+    printf("\nEstimated compression of uncompressed data (%g%% sampled, %s read):\n",
+           opt_estimate, disk + strspn(disk, " "));
+    if (!in)
+    {
+        printf("Nothing sampled.\n");
+        return;
+    }
+    print_table("Type", "Perc", "Disk Usage", "Projected", "Saved");
+    for (j = 0; j < NEST; j++)
+    {
+        uint64_t p = (long double)est_disk * out[j] / in;
+        snprintf(perc, sizeof(perc), "%3u%%", (uint32_t)(out[j] * 100 / in));
+        human_bytes(est_disk, disk);
+        human_bytes(p, proj);
+        human_bytes(est_disk - p, saved);
+        print_table(estimators[j].name, perc, disk, proj, saved);
+    }
+
+    print_est_groups("Directory", &est_dirs);
+    print_est_groups("Extension", &est_exts);
+}
+
+static int cmp_age_anchor(const void *a, const void *b)
+{
+    const struct age_anchor *x = a, *y = b;
+
+    if (x->transid != y->transid)
+        return x->transid < y->transid ? -1 : 1;
+    return x->time < y->time ? -1 : x->time > y->time;
+}
+
+// Sorts the anchors by transid and makes time non-decreasing along them,
+// so that interpolating between neighbours is well-defined.
+static void prepare_age_anchors(void)
+{
+    size_t i, n = 0;
+
+    if (nanchors)
+        qsort(anchors, nanchors, sizeof(*anchors), cmp_age_anchor);
+    for (i = 0; i < nanchors; i++)
+    {
+        if (n && anchors[i].transid == anchors[n - 1].transid)
+            n--; // keep the latest time
+        if (n && anchors[i].time < anchors[n - 1].time)
+            anchors[i].time = anchors[n - 1].time;
+        anchors[n++] = anchors[i];
+    }
+    nanchors = n;
+}
+
+// When a transaction happened, interpolated from the nearest anchors;
+// before the first one, at least as long ago as that.
+static int64_t transid_time(uint64_t transid)
+{
+    size_t lo = 0, hi = nanchors;
+    const struct age_anchor *a, *b;
+
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (anchors[mid].transid < transid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return anchors[0].time;
+    if (lo == nanchors)
+        return anchors[nanchors - 1].time;
+    a = &anchors[lo - 1];
+    b = &anchors[lo];
+    return a->time + (b->time - a->time) * (int64_t)(transid - a->transid)
+                     / (int64_t)(b->transid - a->transid);
+}
+
+#define AGE_BUCKETS 10
+
+static const struct
+{
+        const char *label;
+        int64_t max_age; // seconds
+} age_ranges[] = {
+        { "< 1 day",      86400 },
+        { "1-7 days",     7 * 86400 },
+        { "1-4 weeks",    28 * 86400 },
+        { "1-3 months",   91 * 86400 },
+        { "3-12 months",  365 * 86400 },
+        { "1-2 years",    2 * 365 * 86400 },
+        { "> 2 years",    INT64_MAX },
+};
+
+// Regular extents by the transaction that wrote them, in AGE_BUCKETS equal
+// ranges of generations, or by age in time.
+static void print_age_histogram(struct workspace *ws)
+{
+    struct workspace *hist;
+    struct extent_rec **recs;
+    uint64_t min = -1, max = 0, width;
+    char label[48], perc[8], disk[HB], uncomp[HB], refd[HB], unkn_comp[12];
+    size_t i, n, nb;
+    int64_t now = time(0), age;
+    int b, t;
+
+    if (opt_age == 't')
+    {
+        if (!nanchors)
+        {
+            printf("\nNo inode times to date extents by.\n");
+            return;
+        }
+        prepare_age_anchors();
+    }
+
+    n = collect_extents(ws, &recs);
+    for (i = 0; i < n; i++)
+    {
+        if (recs[i]->generation < min)
+            min = recs[i]->generation;
+        if (recs[i]->generation > max)
+            max = recs[i]->generation;
+    }
+    width = n ? (max - min) / AGE_BUCKETS + 1 : 1;
+    nb = opt_age == 't' ? ARRAY_SIZE(age_ranges) : AGE_BUCKETS;
+
+    hist = calloc(nb, sizeof(*hist));
+    if (!hist)
+        die("Out of memory.\n");
+    for (i = 0; i < n; i++)
+    {
+        if (opt_age == 't')
+        {
+            age = now - transid_time(recs[i]->generation);
+            for (b = 0; age >= age_ranges[b].max_age; b++)
+                ;
+        }
+        else
+            b = (recs[i]->generation - min) / width;
+        t = recs[i]->comp_type;
+        hist[b].disk[t] += recs[i]->disk;
+        hist[b].uncomp[t] += recs[i]->uncomp;
+        hist[b].refd[t] += recs[i]->refd;
+    }
+    free(recs);
+
+    printf("\nRegular extents by %s:\n", opt_age == 't' ? "age" : "generation");
+    printf("%-24s %-10s %-8s %-12s %-12s %-12s\n", opt_age == 't' ? "Age"
+           : "Generations", "Type", "Perc", "Disk Usage", "Uncompressed", "Referenced");
+    for (b = 0; b < nb; b++)
+        for (t = 0; t < MAX_ENTRIES; t++)
+        {
+            if (!hist[b].uncomp[t])
+                continue;
+            if (opt_age == 't')
+                snprintf(label, sizeof(label), "%s", age_ranges[b].label);
+            else
+                snprintf(label, sizeof(label), "%"PRIu64"-%"PRIu64,
+                         min + b * width, min + (b + 1) * width - 1);
+            snprintf(perc, sizeof(perc), "%3u%%",
+                     (uint32_t)(hist[b].disk[t] * 100 / hist[b].uncomp[t]));
+            human_bytes(hist[b].disk[t], disk);
+            human_bytes(hist[b].uncomp[t], uncomp);
+            human_bytes(hist[b].refd[t], refd);
+            printf("%-24s %-10s %-8s %-12s %-12s %-12s\n", label,
+                   type_name(t, unkn_comp), perc, disk, uncomp, refd);
+        }
+
+    free(hist);
+}
+
+// --layout: the chunk tree maps logical ranges (block groups) to stripes
+// on devices, per the RAID profile.
+struct chunk_stripe
+{
+        uint64_t devid, offset;
+};
+
+struct chunk
+{
+        uint64_t start, length, stripe_len, type;
+        uint16_t num_stripes, sub_stripes;
+        struct chunk_stripe *stripes;
+        uint64_t used; // all data in the block group
+        uint64_t disk, raw; // of scanned extents
+};
+
+static struct chunk *chunks;
+static size_t nchunks;
+
+struct layout_dev
+{
+        uint64_t devid, raw;
+};
+
+static struct layout_dev *layout_devs;
+static int nlayout_devs;
+
+static void load_chunks(void)
+{
+    struct btrfs_sv2_args *sv2_args;
+    struct btrfs_ioctl_search_header *head;
+    struct btrfs_ioctl_search_key next;
+    struct btrfs_chunk *item;
+    struct btrfs_stripe *st;
+    struct chunk *c;
+    size_t alloc = 0;
+    uint8_t *bp;
+    uint32_t nr;
+    int i;
+
+    sv2_args = calloc(1, sizeof(*sv2_args));
+    if (!sv2_args)
+        die("Out of memory.\n");
+    sv2_args->key.tree_id = BTRFS_CHUNK_TREE_OBJECTID;
+    sv2_args->key.min_objectid = sv2_args->key.max_objectid = BTRFS_FIRST_CHUNK_TREE_OBJECTID;
+    sv2_args->key.min_type = sv2_args->key.max_type = BTRFS_CHUNK_ITEM_KEY;
+    sv2_args->key.max_offset = -1;
+    sv2_args->key.max_transid = -1;
+    sv2_args->key.nr_items = -1;
+    sv2_args->buf_size = sizeof(sv2_args->buf);
+
+again:
+    if (ioctl(fs_fd, BTRFS_IOC_TREE_SEARCH_V2, sv2_args))
+        die("chunk tree: SEARCH_V2: %m\n");
+    bp = sv2_args->buf;
+    for (nr = sv2_args->key.nr_items; nr > 0; nr--)
+    {
+        head = (struct btrfs_ioctl_search_header*)bp;
+        bp += sizeof(*head);
+        item = (struct btrfs_chunk*)bp;
+        bp += get_unaligned_32(&head->len);
+        if (get_unaligned_32(&head->type) != BTRFS_CHUNK_ITEM_KEY)
+            continue;
+
+        if (nchunks >= alloc)
+        {
+            alloc = alloc ? alloc * 2 : 256;
+            chunks = realloc(chunks, alloc * sizeof(*chunks));
+            if (!chunks)
+                die("Out of memory.\n");
+        }
+        c = &chunks[nchunks++];
+        memset(c, 0, sizeof(*c));
+        c->start       = get_unaligned_64(&head->offset);
+        c->length      = get_unaligned_le64(&item->length);
+        c->stripe_len  = get_unaligned_le64(&item->stripe_len);
+        c->type        = get_unaligned_le64(&item->type);
+        c->num_stripes = get_unaligned_le16(&item->num_stripes);
+        c->sub_stripes = get_unaligned_le16(&item->sub_stripes);
+        c->stripes = calloc(c->num_stripes, sizeof(*c->stripes));
+        if (!c->stripes)
+            die("Out of memory.\n");
+        for (i = 0, st = &item->stripe; i < c->num_stripes; i++, st++)
+        {
+            c->stripes[i].devid  = get_unaligned_le64(&st->devid);
+            c->stripes[i].offset = get_unaligned_le64(&st->offset);
+        }
+    }
+    if (search_continues(sv2_args, &next))
+    {
+        sv2_args->key = next;
+        sv2_args->buf_size = sizeof(sv2_args->buf);
+        goto again;
+    }
+    free(sv2_args);
+}
+
+// How full the block group is, from its item in the extent tree, or in
+// the block group tree on filesystems that have one.
+static uint64_t block_group_used(const struct chunk *c)
+{
+    static const uint64_t trees[] = { BTRFS_EXTENT_TREE_OBJECTID,
+                                      BTRFS_BLOCK_GROUP_TREE_OBJECTID };
+    struct btrfs_ioctl_search_args args;
+    struct btrfs_ioctl_search_header *head;
+    struct btrfs_block_group_item *bg;
+    size_t t;
+
+    for (t = 0; t < ARRAY_SIZE(trees); t++)
+    {
+        memset(&args, 0, sizeof(args));
+        args.key.tree_id = trees[t];
+        args.key.min_objectid = args.key.max_objectid = c->start;
+        args.key.min_type = args.key.max_type = BTRFS_BLOCK_GROUP_ITEM_KEY;
+        args.key.min_offset = args.key.max_offset = c->length;
+        args.key.max_transid = -1;
+        args.key.nr_items = 1;
+        if (ioctl(fs_fd, BTRFS_IOC_TREE_SEARCH, &args) || !args.key.nr_items)
+            continue; // no such tree
+        head = (struct btrfs_ioctl_search_header*)args.buf;
+        bg = (struct btrfs_block_group_item*)(head + 1);
+        return get_unaligned_le64(&bg->used);
+    }
+    return -1;
+}
+
+static const struct
+{
+        uint64_t flag;
+        const char *name;
+} profiles[] = {
+        { 0,                         "single" },
+        { BTRFS_BLOCK_GROUP_DUP,     "DUP" },
+        { BTRFS_BLOCK_GROUP_RAID0,   "RAID0" },
+        { BTRFS_BLOCK_GROUP_RAID1,   "RAID1" },
+        { BTRFS_BLOCK_GROUP_RAID1C3, "RAID1C3" },
+        { BTRFS_BLOCK_GROUP_RAID1C4, "RAID1C4" },
+        { BTRFS_BLOCK_GROUP_RAID10,  "RAID10" },
+        { BTRFS_BLOCK_GROUP_RAID5,   "RAID5" },
+        { BTRFS_BLOCK_GROUP_RAID6,   "RAID6" },
+};
+
+static int profile_index(uint64_t type)
+{
+    int k;
+
+    for (k = ARRAY_SIZE(profiles) - 1; k > 0; k--)
+        if (type & profiles[k].flag)
+            break;
+    return k;
+}
+
+static void add_dev_raw(struct chunk *c, int stripe, uint64_t bytes)
+{
+    uint64_t devid = c->stripes[stripe].devid;
+    int i;
+
+    c->raw += bytes;
+    for (i = 0; i < nlayout_devs; i++)
+        if (layout_devs[i].devid == devid)
+            break;
+    if (i == nlayout_devs)
+    {
+        layout_devs = add_entry(layout_devs, &nlayout_devs, sizeof(*layout_devs));
+        layout_devs[i].devid = devid;
+    }
+    layout_devs[i].raw += bytes;
+}
+
+// Charges each device for its share of [off, off+len) within the chunk:
+// every mirror in full, striped profiles piece by piece, and RAID5/6 their
+// parity in proportion to the data.
+static void map_extent(struct chunk *c, uint64_t off, uint64_t len)
+{
+    uint64_t nr, full, piece, parity_bytes = 0;
+    int n = c->num_stripes, ndata = n, copies = 1, nparity = 0, i;
+
+    if (!n)
+        return;
+    if (c->type & BTRFS_BLOCK_GROUP_RAID10)
+    {
+        copies = c->sub_stripes ? c->sub_stripes : 2;
+        ndata = n / copies;
+    }
+    else if (c->type & BTRFS_BLOCK_GROUP_RAID5)
+        nparity = 1, ndata = n - 1;
+    else if (c->type & BTRFS_BLOCK_GROUP_RAID6)
+        nparity = 2, ndata = n - 2;
+    else if (!(c->type & BTRFS_BLOCK_GROUP_RAID0))
+    {
+        // mirrored (or single): every stripe holds it all
+        for (i = 0; i < n; i++)
+            add_dev_raw(c, i, len);
+        return;
+    }
+    if (!c->stripe_len || ndata < 1)
+        return;
+
+    while (len)
+    {
+        nr = off / c->stripe_len;
+        piece = c->stripe_len - off % c->stripe_len;
+        if (piece > len)
+            piece = len;
+        if (nparity)
+        {
+            // parity rotates by one device each full stripe
+            full = nr / ndata;
+            add_dev_raw(c, (nr % ndata + full) % n, piece);
+            parity_bytes += piece;
+            for (i = 0; i < nparity; i++)
+                add_dev_raw(c, (ndata + i + full) % n,
+                            parity_bytes / ndata - (parity_bytes - piece) / ndata);
+        }
+        else
+            for (i = 0; i < copies; i++)
+                add_dev_raw(c, (nr % ndata) * copies + i, piece);
+        off += piece;
+        len -= piece;
+    }
+}
+
+static int cmp_layout_dev(const void *a, const void *b)
+{
+    const struct layout_dev *x = a, *y = b;
+
+    return x->devid < y->devid ? -1 : x->devid > y->devid;
+}
+
+// Where the scanned extents physically are: raw bytes per RAID profile and
+// device, and how full the block groups holding them are.
+static void print_layout(struct workspace *ws)
+{
+    struct extent_rec **recs;
+    struct chunk *c;
+    uint64_t disk = 0, raw = 0, unmapped = 0;
+    uint64_t pdisk[ARRAY_SIZE(profiles)] = {0}, praw[ARRAY_SIZE(profiles)] = {0};
+    char size[HB], used[HB], dbuf[HB], rbuf[HB];
+    size_t i, j, k, n;
+
+    if (fs_fd == -1)
+        return;
+    load_chunks();
+
+    // Both are in logical address order.
+    n = collect_extents(ws, &recs);
+    for (i = j = 0; i < n; i++)
+    {
+        while (j < nchunks && chunks[j].start + chunks[j].length <= recs[i]->bytenr)
+            j++;
+        if (j == nchunks || chunks[j].start > recs[i]->bytenr)
+        {
+            unmapped += recs[i]->disk;
+            continue;
+        }
+        chunks[j].disk += recs[i]->disk;
+        map_extent(&chunks[j], recs[i]->bytenr - chunks[j].start, recs[i]->disk);
+    }
+    free(recs);
+
+    for (i = 0; i < nchunks; i++)
+    {
+        pdisk[profile_index(chunks[i].type)] += chunks[i].disk;
+        praw[profile_index(chunks[i].type)] += chunks[i].raw;
+    }
+
+    printf("\nPhysical layout:\n");
+    printf("%-10s %-12s %-12s\n", "Profile", "Disk Usage", "Raw Usage");
+    for (k = 0; k < ARRAY_SIZE(profiles); k++)
     {
-        switch (getopt_long(argc, argv, short_options, long_options, 0))
+        if (!pdisk[k])
+            continue;
+        human_bytes(pdisk[k], dbuf);
+        human_bytes(praw[k], rbuf);
+        printf("%-10s %-12s %-12s\n", profiles[k].name, dbuf, rbuf);
+        disk += pdisk[k];
+        raw += praw[k];
+    }
+    human_bytes(disk, dbuf);
+    human_bytes(raw, rbuf);
+    printf("%-10s %-12s %-12s\n", "TOTAL", dbuf, rbuf);
+    if (unmapped)
+    {
+        human_bytes(unmapped, dbuf);
+        printf("Not in any chunk (freed since?): %s\n", dbuf);
+    }
+
+    if (nlayout_devs)
+        qsort(layout_devs, nlayout_devs, sizeof(*layout_devs), cmp_layout_dev);
+    printf("\n%-10s %-12s\n", "Device", "Raw Usage");
+    for (i = 0; i < nlayout_devs; i++)
+    {
+        human_bytes(layout_devs[i].raw, rbuf);
+        printf("%-10"PRIu64" %-12s\n", layout_devs[i].devid, rbuf);
+    }
+
+    printf("\n%-20s %-10s %-12s %-12s %-6s %-12s %-6s\n", "Block group",
+           "Profile", "Size", "Used", "", "Scanned", "");
+    for (i = 0; i < nchunks; i++)
+    {
+        c = &chunks[i];
+        if (!c->disk)
+            continue;
+        c->used = block_group_used(c);
+        human_bytes(c->length, size);
+        human_bytes(c->disk, dbuf);
+        if (c->used == (uint64_t)-1)
+            printf("%-20"PRIu64" %-10s %-12s %-12s %-6s %-12s %3u%%\n", c->start,
+                   profiles[profile_index(c->type)].name, size, "?", "", dbuf,
+                   (uint32_t)(c->disk * 100 / c->length));
+        else
         {
-        case 'b':
-            opt_bytes = 1;
-            break;
-        case 'x':
-            opt_one_fs = 1;
-            break;
-        case 'h':
-            print_help();
-            exit(0);
-            break; // unreachable
-        case -1:
-            return;
-        default:
-            exit(1);
+            human_bytes(c->used, used);
+            printf("%-20"PRIu64" %-10s %-12s %-12s %3u%%   %-12s %3u%%\n", c->start,
+                   profiles[profile_index(c->type)].name, size, used,
+                   (uint32_t)(c->used * 100 / c->length), dbuf,
+                   (uint32_t)(c->disk * 100 / c->length));
         }
     }
 }
 
-static int print_stats(struct workspace *ws)
+struct owner_row
 {
-    char perc[8], disk_usage[HB], uncomp_usage[HB], refd_usage[HB];
-    uint32_t percentage;
-    int t;
+        const char *id;
+        struct owner_stats *o;
+};
 
-    ws->uncomp_all = ws->disk_all = ws->refd_all = 0;
-    for (t=0; t<MAX_ENTRIES; t++)
+static int cmp_owner_row(const void *a, const void *b)
+{
+    const struct owner_stats *x = ((const struct owner_row *)a)->o;
+    const struct owner_stats *y = ((const struct owner_row *)b)->o;
+
+    return x->disk > y->disk ? -1 : x->disk < y->disk;
+}
+
+static void print_owners(struct workspace *ws)
+{
+    struct extent_rec **recs;
+    struct owner_row *rows;
+    struct passwd *pw;
+    struct group *gr;
+    char name[32], perc[8], disk[HB], uncomp[HB], refd[HB], shared[HB];
+    const char *label;
+    size_t i, n, nrows = 0;
+
+    n = collect_extents(ws, &recs);
+    for (i = 0; i < n; i++)
+        if ((recs[i]->flags & EXT_OWNERS) && recs[i]->owner)
+            recs[i]->owner->shared += recs[i]->disk;
+    free(recs);
+
+    rows = calloc(owners.n + 1, sizeof(*rows));
+    if (!rows)
+        die("Out of memory.\n");
+    for (i = 0; i < owners.size; i++)
+        if (owners.slots[i].name)
+        {
+            rows[nrows].id = owners.slots[i].name;
+            rows[nrows++].o = owners.slots[i].value;
+        }
+    qsort(rows, nrows, sizeof(*rows), cmp_owner_row);
+
+    printf("\nBy %s (disk usage charged to the first owner found):\n",
+           opt_owner == 'g' ? "group" : "user");
+    printf("%-16s %-10s %-8s %-12s %-12s %-12s %-12s\n", opt_owner == 'g' ? "Group"
+           : "User", "Files", "Perc", "Disk Usage", "Uncompressed", "Referenced",
+           "Shared");
+    for (i = 0; i < nrows; i++)
     {
-            ws->uncomp_all += ws->uncomp[t];
-            ws->disk_all   += ws->disk[t];
-            ws->refd_all   += ws->refd[t];
+        struct owner_stats *o = rows[i].o;
+
+        label = rows[i].id;
+        if (opt_owner == 'g' && (gr = getgrgid(atoi(rows[i].id))))
+            label = gr->gr_name;
+        else if (opt_owner == 'u' && (pw = getpwuid(atoi(rows[i].id))))
+            label = pw->pw_name;
+        snprintf(name, sizeof(name), "%s", label);
+        if (o->uncomp)
+            snprintf(perc, sizeof(perc), "%3u%%", (uint32_t)(o->disk * 100 / o->uncomp));
+        else
+            snprintf(perc, sizeof(perc), "%s", "-");
+        human_bytes(o->disk, disk);
+        human_bytes(o->uncomp, uncomp);
+        human_bytes(o->refd, refd);
+        human_bytes(o->shared, shared);
+        printf("%-16s %-10"PRIu64" %-8s %-12s %-12s %-12s %-12s\n", name, o->nfiles,
+               perc, disk, uncomp, refd, shared);
     }
+    free(rows);
+}
 
-    if (!ws->uncomp_all)
+static int cmp_ext_row(const void *a, const void *b)
+{
+    const struct ext_stats *x = ((const struct name_slot *)a)->value;
+    const struct ext_stats *y = ((const struct name_slot *)b)->value;
+
+    return x->disk > y->disk ? -1 : x->disk < y->disk;
+}
+
+static void print_ext_rows(const char *ext, struct ext_stats *e)
+{
+    char perc[8], disk[HB], uncomp[HB], refd[HB], unkn_comp[12];
+    int i;
+
+    for (i = 0; i < e->ntypes; i++)
     {
-        if (!ws->nfiles)
-            fprintf(stderr, "No files.\n");
+        struct ext_type *et = &e->types[i];
+
+        if (et->uncomp)
+            snprintf(perc, sizeof(perc), "%3u%%", (uint32_t)(et->disk * 100 / et->uncomp));
         else
-            fprintf(stderr, "All empty or still-delalloced files.\n");
-        return 1;
+            snprintf(perc, sizeof(perc), "%s", "-");
+        human_bytes(et->disk, disk);
+        human_bytes(et->uncomp, uncomp);
+        human_bytes(et->refd, refd);
+        printf("%-16s %-10s %-8s %-12s %-12s %-12s\n", ext,
+               type_name(et->type, unkn_comp), perc, disk, uncomp, refd);
     }
+}
 
-    printf("Processed %"PRIu64" file%s, %"PRIu64" regular extents "
-           "(%"PRIu64" refs), %"PRIu64" inline, %"PRIu64" fragments.\n",
-           ws->nfiles, ws->nfiles>1 ? "s" : "",
-           ws->nextents, ws->nrefs, ws->ninline, ws->nfrag);
+// The opt_by_ext extensions using the most disk, then all the others.
+static void print_by_ext(void)
+{
+    struct name_slot *rows;
+    struct ext_stats other = { 0 };
+    size_t i, n = 0;
+    int j;
 
-    print_table("Type", "Perc", "Disk Usage", "Uncompressed", "Referenced");
-    percentage = ws->disk_all*100/ws->uncomp_all;
-    snprintf(perc, sizeof(perc), "%3u%%", percentage);
-    human_bytes(ws->disk_all, disk_usage);
-    human_bytes(ws->uncomp_all, uncomp_usage);
-    human_bytes(ws->refd_all, refd_usage);
-    print_table("TOTAL", perc, disk_usage, uncomp_usage, refd_usage);
+    rows = calloc(exts.n + 1, sizeof(*rows));
+    if (!rows)
+        die("Out of memory.\n");
+    for (i = 0; i < exts.size; i++)
+        if (exts.slots[i].name)
+            rows[n++] = exts.slots[i];
+    qsort(rows, n, sizeof(*rows), cmp_ext_row);
 
-    for (t=0; t<MAX_ENTRIES; t++)
+    printf("\nBy file extension (disk usage charged to the first file found):\n");
+    printf("%-16s %-10s %-8s %-12s %-12s %-12s\n", "Extension", "Type", "Perc",
+           "Disk Usage", "Uncompressed", "Referenced");
+    for (i = 0; i < n; i++)
     {
-        if (!ws->uncomp[t])
+        struct ext_stats *e = rows[i].value;
+
+        if (i < (size_t)opt_by_ext)
+        {
+            print_ext_rows(*rows[i].name ? rows[i].name : "(none)", e);
             continue;
-        const char *ct = t==PREALLOC? "prealloc" : comp_types[t];
-        char unkn_comp[12];
-        percentage = ws->disk[t]*100/ws->uncomp[t];
-        snprintf(perc, sizeof(perc), "%3u%%", percentage);
-        human_bytes(ws->disk[t], disk_usage);
-        human_bytes(ws->uncomp[t], uncomp_usage);
-        human_bytes(ws->refd[t], refd_usage);
-        if (!ct)
+        }
+        for (j = 0; j < e->ntypes; j++)
         {
-            snprintf(unkn_comp, sizeof(unkn_comp), "?%u", t);
-            ct = unkn_comp;
+            struct ext_type *et = ext_type(&other, e->types[j].type);
+            et->disk += e->types[j].disk;
+            et->uncomp += e->types[j].uncomp;
+            et->refd += e->types[j].refd;
         }
-        print_table(ct, perc, disk_usage, uncomp_usage, refd_usage);
     }
+    if (other.ntypes)
+        print_ext_rows("(others)", &other);
+    free(other.types);
+    free(rows);
+}
+
+static int cmp_amp_file(const void *a, const void *b)
+{
+    const struct amp_file *x = a, *y = b;
+
+    return x->extra > y->extra ? -1 : x->extra < y->extra;
+}
+
+static void print_read_amp(void)
+{
+    char refd[HB], ram[HB], unkn_comp[12];
+    int t, i;
+
+    printf("\nRead amplification (decompressed per referenced byte, regular extents):\n");
+    printf("%-10s %-10s %-12s %-12s %-8s %-8s\n", "Type", "Refs", "Referenced",
+           "Decompressed", "Average", "Worst");
+    for (t = 0; t < MAX_ENTRIES; t++)
+    {
+        if (!amp_refd[t])
+            continue;
+        human_bytes(amp_refd[t], refd);
+        human_bytes(amp_ram[t], ram);
+        printf("%-10s %-10"PRIu64" %-12s %-12s %-8.2f %-8.2f\n", type_name(t, unkn_comp),
+               amp_refs[t], refd, ram, (double)amp_ram[t] / amp_refd[t], amp_worst[t]);
+    }
+
+    if (!namp_files)
+        return;
+    qsort(amp_files, namp_files, sizeof(*amp_files), cmp_amp_file);
+    printf("\nFiles decompressing the most beyond what they reference:\n");
+    printf("%-12s %-8s %-8s %s\n", "Extra", "Average", "Worst", "Path");
+    for (i = 0; i < namp_files; i++)
+    {
+        human_bytes(amp_files[i].extra, ram);
+        printf("%-12s %-8.2f %-8.2f %s\n", ram, amp_files[i].avg, amp_files[i].worst,
+               amp_files[i].path);
+        free(amp_files[i].path);
+    }
+    free(amp_files);
+}
+
+static void print_per_arg(void)
+{
+    int i;
+
+    for (i = 0; i < ngroups; i++)
+    {
+        printf("%s:\n", groups[i].label);
+        print_stats(groups[i].ws);
+        printf("\n");
+        free(groups[i].ws);
+    }
+}
+
+// What's referenced from more than one argument, counted once.
+static void print_cross_group(struct workspace *ws)
+{
+    struct extent_rec **recs;
+    struct workspace *sh;
+    size_t i, n;
+
+    sh = calloc(sizeof(*sh), 1);
+    if (!sh)
+        die("Out of memory.\n");
+    n = collect_extents(ws, &recs);
+    for (i = 0; i < n; i++)
+    {
+        uint64_t m = recs[i]->groups;
+        if (!(m & (m - 1)))
+            continue;
+        sh->disk[recs[i]->comp_type] += recs[i]->disk;
+        sh->uncomp[recs[i]->comp_type] += recs[i]->uncomp;
+        sh->refd[recs[i]->comp_type] += recs[i]->refd;
+    }
+    free(recs);
+
+    sum_types(sh);
+    printf("\nShared between arguments:\n");
+    print_type_table(sh);
+    free(sh);
+}
+
+// --watch: after the first scan, follow fanotify events for the whole
+// filesystem and redo just the files that changed.
+#define WATCH_EVENTS (FAN_MODIFY | FAN_DELETE_SELF | FAN_CREATE | FAN_DELETE \
+                      | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR)
+
+static int watch_init(char **paths, int npaths)
+{
+    int fan, i;
+
+    fan = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_UNLIMITED_QUEUE
+                        | FAN_REPORT_DFID_NAME_TARGET, O_RDONLY);
+    if (fan == -1)
+    {
+        if (errno == EINVAL)
+            die("--watch needs kernel 5.17+.\n");
+        die("fanotify_init: %m\n");
+    }
+    // Marks go before the first scan, so that nothing slips in between.
+    for (i = 0; i < npaths; i++)
+        if (fanotify_mark(fan, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                          WATCH_EVENTS, AT_FDCWD, paths[i]))
+            die("%s: fanotify_mark: %m\n", paths[i]);
+    return fan;
+}
+
+// struct file_handle, which glibc only declares with _GNU_SOURCE.
+struct fid_handle
+{
+        uint32_t bytes;
+        int32_t type;
+        uint8_t data[];
+};
+
+// Btrfs file handles start with the inode number, then the subvolume's.
+static int decode_fid(const struct fanotify_event_info_fid *fid,
+                      uint64_t *root, uint64_t *ino)
+{
+    const struct fid_handle *fh = (const struct fid_handle *)fid->handle;
 
+    if (fh->bytes < 16)
+        return -1;
+    *ino = get_unaligned_64(fh->data);
+    *root = get_unaligned_64(fh->data + 8);
     return 0;
 }
 
+struct pending_file
+{
+        uint64_t root, ino;
+        int created; // not watched yet
+};
+
+static struct pending_file *dirty;
+static size_t ndirty, dirty_alloc;
+
+static void mark_dirty(uint64_t root, uint64_t ino, int created)
+{
+    if (ndirty >= dirty_alloc)
+    {
+        dirty_alloc = dirty_alloc ? dirty_alloc * 2 : 256;
+        dirty = realloc(dirty, dirty_alloc * sizeof(*dirty));
+        if (!dirty)
+            die("Out of memory.\n");
+    }
+    dirty[ndirty].root = root;
+    dirty[ndirty].ino = ino;
+    dirty[ndirty].created = created;
+    ndirty++;
+}
+
+static void handle_event(struct fanotify_event_metadata *m, struct workspace *ws)
+{
+    struct fanotify_event_info_header *info;
+    struct fanotify_event_info_fid *fid;
+    struct watched_file *w = 0;
+    struct watch_root *wr = 0, *dwr = 0;
+    uint64_t root = 0, ino = 0, dino = 0;
+    const char *name = 0, *dir = 0;
+    int have_child = 0;
+    char *path;
+    size_t off;
+
+    for (off = m->metadata_len; off < m->event_len; off += info->len)
+    {
+        info = (struct fanotify_event_info_header *)((char *)m + off);
+        fid = (struct fanotify_event_info_fid *)info;
+        if (info->info_type == FAN_EVENT_INFO_TYPE_FID)
+        {
+            if (decode_fid(fid, &root, &ino))
+                continue;
+            have_child = 1;
+            if ((wr = find_watch_root(root, 0)))
+                w = radix_tree_lookup(&wr->files, ino);
+        }
+        else if (info->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+        {
+            uint64_t droot;
+            const struct fid_handle *fh = (const struct fid_handle *)fid->handle;
+
+            if (decode_fid(fid, &droot, &dino))
+                continue;
+            name = (const char *)fh->data + fh->bytes;
+            if ((dwr = find_watch_root(droot, 0)))
+                dir = radix_tree_lookup(&dwr->dirs, dino);
+        }
+    }
+
+    if (m->mask & FAN_ONDIR)
+    {
+        if ((m->mask & (FAN_DELETE | FAN_MOVED_FROM)) && have_child && wr)
+        {
+            radix_begin();
+            free(radix_tree_delete(&wr->dirs, ino));
+            radix_end();
+        }
+        if ((m->mask & (FAN_CREATE | FAN_MOVED_TO)) && dir && name)
+        {
+            if (!(path = malloc(strlen(dir) + strlen(name) + 2)))
+                die("Out of memory.\n");
+            sprintf(path, "%s/%s", dir, name);
+            do_recursive_search(path, ws);
+            free(path);
+        }
+        return;
+    }
+
+    // Gone.  Losing a name, it may still have others (hardlinks): the
+    // rescan's inode item search tells.
+    if ((m->mask & FAN_DELETE_SELF) && w)
+        unwatch_file(ws, wr, w);
+    else if ((m->mask & (FAN_MODIFY | FAN_DELETE | FAN_MOVED_FROM)) && w
+             && !w->dirty)
+    {
+        w->dirty = 1;
+        mark_dirty(root, ino, 0);
+    }
+    else if ((m->mask & (FAN_CREATE | FAN_MOVED_TO)) && dir && have_child
+             && !w && root == dwr->root)
+        mark_dirty(root, ino, 1);
+}
+
+// Searches files that changed or appeared, by inode, from any directory of
+// their subvolume; with inode items, so that deleted ones drop out.
+static void rescan_dirty(struct workspace *ws)
+{
+    struct watched_file *w;
+    struct watch_root *wr;
+    struct file_batch *b;
+    char name[64];
+    size_t i;
+
+    for (i = 0; i < ndirty; i++)
+    {
+        if (!(wr = find_watch_root(dirty[i].root, 0)) || wr->fd == -1)
+            continue;
+        // Modified, but dropped since.
+        w = radix_tree_lookup(&wr->files, dirty[i].ino);
+        if (!dirty[i].created && (!w || !w->dirty))
+            continue;
+        snprintf(name, sizeof(name), "subvolume %"PRIu64" inode %"PRIu64,
+                 dirty[i].root, dirty[i].ino);
+        b = new_batch(1, strlen(name) + 1);
+        b->root = dirty[i].root;
+        b->ino[0] = dirty[i].ino;
+        b->path[0] = 0;
+        strcpy(b->paths, name);
+        search_batch(wr->fd, 0, b, ws);
+    }
+    ndirty = 0;
+}
+
+// Lost events: start over.  Directories are just rescanned over.
+static void rescan_all(struct workspace *ws, char **paths, int npaths)
+{
+    void *batch[256];
+    unsigned int got, j;
+    int i;
+
+    for (i = 0; i < nwatch_roots; i++)
+    {
+        struct watch_root *wr = watch_roots[i];
+
+        while ((got = radix_tree_gang_lookup(&wr->files, batch, 0, ARRAY_SIZE(batch))))
+            for (j = 0; j < got; j++)
+                unwatch_file(ws, wr, batch[j]);
+    }
+    ndirty = 0;
+    for (i = 0; i < npaths; i++)
+        do_recursive_search(paths[i], ws);
+}
+
+static void watch_loop(int fan, struct workspace *ws, char **paths, int npaths)
+{
+    char buf[65536] __attribute__((aligned(8)));
+    struct fanotify_event_metadata *m;
+    struct pollfd pfd = { fan, POLLIN, 0 };
+    uint64_t next, now;
+    char stamp[32];
+    time_t t;
+    ssize_t len;
+    int overflow;
+
+    // Rescans go by inode number, from the subvolume's directory handle.
+    opt_inode_items = 1;
+    opt_frag_report = 0;
+
+    next = now_ns() + opt_watch * 1000000000ULL;
+    while (1)
+    {
+        now = now_ns();
+        if (now >= next)
+        {
+            rescan_dirty(ws);
+            t = time(0);
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&t));
+            printf("\n%s\n", stamp);
+            print_stats(ws);
+            fflush(stdout);
+            next += opt_watch * 1000000000ULL;
+            continue;
+        }
+        if (poll(&pfd, 1, (next - now + 999999) / 1000000) <= 0)
+            continue;
+
+        if ((len = read(fan, buf, sizeof(buf))) <= 0)
+        {
+            if (len == -1 && errno == EINTR)
+                continue;
+            die("fanotify read: %m\n");
+        }
+        overflow = 0;
+        for (m = (void *)buf; FAN_EVENT_OK(m, len); m = FAN_EVENT_NEXT(m, len))
+        {
+            if (m->mask & FAN_Q_OVERFLOW)
+                overflow = 1;
+            else
+                handle_event(m, ws);
+        }
+        if (overflow)
+        {
+            fprintf(stderr, "fanotify queue overflow, rescanning.\n");
+            rescan_all(ws, paths, npaths);
+        }
+    }
+}
+
+// The combined totals and whatever reports were asked for.
+static int print_summary(struct workspace *ws)
+{
+    int ret;
+
+    if (opt_per_arg)
+    {
+        print_per_arg();
+        printf("Combined:\n");
+    }
+    ret = print_stats(ws);
+
+    if (opt_per_arg && !ret)
+        print_cross_group(ws);
+
+    if (opt_exclusive && !ret)
+        print_exclusive(ws);
+
+    if (opt_share_matrix && !ret)
+        print_share_matrix(ws);
+
+    if (opt_share_histogram && !ret)
+        print_share_histogram(ws);
+
+    if (opt_bookend && !ret)
+        print_bookend(ws);
+
+    if (opt_estimate && !ret)
+        print_estimate();
+
+    if (opt_age && !ret)
+        print_age_histogram(ws);
+
+    if (opt_layout && !ret)
+        print_layout(ws);
+
+    if (opt_owner && !ret)
+        print_owners(ws);
+
+    if (opt_by_ext && !ret)
+        print_by_ext();
+
+    if (opt_read_amp && !ret)
+        print_read_amp();
+
+    return ret;
+}
+
 int main(int argc, char **argv)
 {
     struct workspace *ws;
+    uint64_t read_before;
+    int fan = -1, first, resume_arg = -1;
+    size_t k;
 
     ws = (struct workspace *) calloc(sizeof(*ws), 1);
 
     parse_options(argc, argv);
+    if (opt_per_arg && opt_share_matrix == 's')
+        die("--per-arg and --share-matrix=subvol can't be combined.\n");
+    if (!opt_jobs)
+        opt_jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
 
     if (optind >= argc)
     {
@@ -455,10 +5312,145 @@ int main(int argc, char **argv)
     INIT_RADIX_TREE(&ws->seen_extents, 0);
     signal(SIGUSR1, sigusr1);
 
+    if ((opt_share_matrix == 'a' || opt_per_arg) && argc - optind > MAX_GROUPS)
+        die("Can't compare more than %d arguments.\n", MAX_GROUPS);
+
+    if (opt_merge)
+    {
+        if (opt_per_arg || opt_share_matrix || opt_exclusive || opt_frag_report
+            || opt_layout || opt_per_file || opt_owner || opt_by_ext
+            || opt_read_amp)
+            die("--merge only supports the combined totals.\n");
+        merge_sets(argv + optind, argc - optind, ws);
+        int ret = print_stats(ws);
+        free(ws);
+        return ret;
+    }
+
+    if (opt_watch && (opt_per_arg || opt_share_matrix || opt_exclusive || opt_per_file
+                      || opt_owner || opt_by_ext || opt_read_amp))
+        die("--watch only supports the combined totals.\n");
+    if (opt_watch && opt_fiemap)
+        die("--watch needs SEARCH_V2, not --fiemap.\n");
+    if (opt_age && opt_fiemap)
+        die("--age needs SEARCH_V2, FIEMAP doesn't tell generations.\n");
+
+    if (opt_resume && !opt_checkpoint)
+        die("--resume needs --checkpoint=FILE.\n");
+    if (opt_checkpoint && (opt_extent_recs || opt_per_arg || opt_share_matrix
+        || opt_exclusive || opt_frag_report || opt_watch || opt_per_file
+        || opt_estimate || opt_by_ext || opt_read_amp))
+        die("--checkpoint only supports the combined totals.\n");
+
+    if (opt_idle)
+        go_idle();
+
+    first = optind;
+    if (opt_checkpoint)
+    {
+        ckpt_args = argv + first;
+        ckpt_nargs = argc - first;
+        if (opt_resume)
+            resume_arg = load_checkpoint(ws);
+        ckpt_last = time(0);
+        signal(SIGTERM, sigterm);
+        signal(SIGINT, sigterm);
+    }
+
+    if (opt_watch)
+        fan = watch_init(argv + first, argc - first);
+
+    if (opt_scan_stats && io_read_bytes(&read_before))
+        read_before = -1;
+
+    if (opt_per_file)
+    {
+        if (!strcmp(opt_per_file, "-"))
+            per_file_out = stdout;
+        else if (!(per_file_out = fopen(opt_per_file, "w")))
+            die("%s: %m\n", opt_per_file);
+        setvbuf(per_file_out, 0, _IOFBF, 1 << 20);
+    }
+
+    if (opt_frag_report)
+    {
+        if (!strcmp(opt_frag_file, "-"))
+        {
+            if (per_file_out == stdout)
+                die("--per-file and --frag-report can't both use stdout.\n");
+            frag_out = stdout;
+        }
+        else if (!(frag_out = fopen(opt_frag_file, "w")))
+            die("%s: %m\n", opt_frag_file);
+    }
+
+    if (opt_pipeline)
+        start_pipeline(opt_pipeline, ws);
+
+    if (resume_arg >= 0)
+        optind = first + resume_arg;
     for (; argv[optind]; optind++)
-        do_recursive_search(argv[optind], ws, NULL);
+    {
+        if (opt_share_matrix == 'a' || opt_per_arg)
+            scan_group = add_group(argv[optind], 0);
+        if (opt_per_arg)
+        {
+            groups[scan_group].ws = calloc(sizeof(*ws), 1);
+            if (!groups[scan_group].ws)
+                die("Out of memory.\n");
+        }
+        ckpt_arg = optind - first;
+        if (resume_arg >= 0)
+        {
+            // load_checkpoint() left its pending directories on the stack.
+            resume_arg = -1;
+            set_anchor(argv[optind]);
+            walk_pending(ws);
+        }
+        else
+            do_recursive_search(argv[optind], ws);
+    }
+
+    // Interrupted in the last directory: all that's left is the output.
+    if (opt_checkpoint && sig_checkpoint)
+        maybe_checkpoint(ws);
+    if (opt_pipeline)
+        stop_pipeline();
+    if (opt_checkpoint && unlink(opt_checkpoint) && errno != ENOENT)
+        die("%s: %m\n", opt_checkpoint);
+    ws->group = 0;
+
+    if (per_file_out && (fflush(per_file_out) || ferror(per_file_out)
+                         || (per_file_out != stdout && fclose(per_file_out))))
+        die("%s: %m\n", opt_per_file);
+
+    if (opt_scan_stats)
+        print_scan_stats(read_before);
 
-    int ret = print_stats(ws);
+    if (opt_emit_set)
+        emit_set(ws, opt_emit_set);
+
+    if (opt_frag_report)
+        print_frag_report();
+
+    // Records on standard output are the output: no tables after them.
+    int ret = per_file_out == stdout || frag_out == stdout ? 0 : print_summary(ws);
+
+    if (nerrors)
+    {
+        fflush(stdout);
+        fprintf(stderr, "\n%zu error%s, not (fully) counted:\n", nerrors,
+                nerrors > 1 ? "s" : "");
+        for (k = 0; k < nerrors; k++)
+            fputs(errors[k], stderr);
+        ret = 1;
+    }
+
+    if (opt_watch)
+    {
+        fflush(stdout);
+        watch_loop(fan, ws, argv + first, argc - first);
+    }
 
     free(ws);
 
@@ -0,0 +1,40 @@
+#!/bin/sh
+# --watch must keep counting a file when one of its two hardlinks is
+# deleted.  Needs root and a scratch directory on btrfs; skipped (exit 77)
+# otherwise.
+#
+# Usage: [COMPSIZE=./compsize] tests/watch-hardlink.sh dir-on-btrfs
+set -e
+
+COMPSIZE=${COMPSIZE:-$(dirname "$0")/../compsize}
+[ $# -eq 1 ] && [ "$(id -u)" = 0 ] \
+    && [ "$(stat -f -c %T "$1" 2>/dev/null)" = btrfs ] \
+    || { echo "SKIP: needs root and a directory on btrfs" >&2; exit 77; }
+
+t=$(mktemp -d "$1/compsize-test.XXXXXX")
+out=$t.out
+trap 'kill $pid 2>/dev/null || true; rm -rf "$t" "$out"' EXIT
+
+head -c 1048576 /dev/urandom > "$t/a"
+ln "$t/a" "$t/b"
+sync
+
+"$COMPSIZE" --watch=1 "$t" > "$out" &
+pid=$!
+sleep 2
+rm "$t/b"
+sync
+sleep 3
+kill $pid
+wait $pid 2>/dev/null || true
+
+first=$(grep -m1 '^TOTAL' "$out")
+last=$(grep '^TOTAL' "$out" | tail -n1)
+files=$(grep '^Processed' "$out" | tail -n1)
+echo "before: $first"
+echo "after:  $last"
+echo "$files"
+[ -n "$first" ] && [ "$first" = "$last" ] \
+    && echo "$files" | grep -q '^Processed 1 file' \
+    || { echo "FAIL: deleting one hardlink changed the totals" >&2; exit 1; }
+echo PASS